@@ -30,6 +30,14 @@
 
 #define SAFE_NAME_SIZE 61
 
+#define INODE_SHIFT              6
+
+/* specialized zone walks: 1K, 2K and 4K blocks, log_zone_size 0..3 */
+#define FAST_MIN_BLK_SHIFT       10
+#define FAST_MAX_LOG_ZONE        3
+#define FAST_PATHS               12
+#define FAST_MAX_BLOCK           4096
+
 typedef struct __attribute__((packed)) partition_entry {
   uint8_t  bootind;
   uint8_t  start_head;
@@ -97,6 +105,10 @@ typedef struct {
   uint32_t ptrs_per_blk;
   uint32_t links_per_zone;
   uint32_t ino_per_block;
+  uint32_t blk_shift;
+  uint32_t zone_shift;
+  int      fast_path;
+  int      swapped;
   struct superblock sb;
 } fs_info;
 
@@ -0,0 +1,262 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "minfs_common.h"
+#include "min.h"
+
+#define BASE 10
+#define MAXPART 3
+#define MINPART 0
+
+#define DEFAULT_ROUNDS 200
+#define DEFAULT_TRIALS 10
+#define NSEC 1000000000.0
+
+#define USAGE "usage: minbench [ -v ] [ -r rounds ] [ -n trials ] " \
+  "[ -p num [ -s num ] ] imagefile\n"
+
+/* what the callback keeps so the walk cannot be optimized away */
+typedef struct {
+  uint64_t spans;
+  uint64_t bytes;
+  uint64_t check;
+} bench_sink;
+
+static int verbose = 0;
+static int primary = -1;
+static int subpart = -1;
+static long rounds = DEFAULT_ROUNDS;
+static long trials = DEFAULT_TRIALS;
+const char *imagefile = NULL;
+
+/* parse command line arguments */
+void parse_options(int argc, char *argv[]) {
+  int opt;
+  char *end;
+
+  while ((opt = getopt(argc, argv, "vr:n:p:s:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'r':
+        rounds = strtol(optarg, &end, BASE);
+        if (end == optarg || *end != '\0' || rounds < 1) {
+          fprintf(stderr, "-r usage: r <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'n':
+        trials = strtol(optarg, &end, BASE);
+        if (end == optarg || *end != '\0' || trials < 1) {
+          fprintf(stderr, "-n usage: n <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'p':
+        primary = strtol(optarg, &end, BASE);
+        if (end == optarg || errno == ERANGE) {
+          fprintf(stderr, "-p usage: p <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        if (primary > MAXPART || primary < MINPART) {
+          fprintf(stderr,
+            "Partition %d out of range.  Must be 0..3.\n", primary);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 's':
+        subpart = strtol(optarg, &end, BASE);
+        if (end == optarg || errno == ERANGE) {
+          fprintf(stderr, "-s usage: s <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        if (subpart > MAXPART || subpart < MINPART) {
+          fprintf(stderr,
+            "Partition %d out of range.  Must be 0..3.\n", subpart);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  /* subpartition requires a primary partition */
+  if (subpart != -1 && primary == -1) {
+    fprintf(stderr, "usage: -s requires -p\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (argc - optind != 1) {
+    fprintf(stderr, USAGE);
+    exit(EXIT_FAILURE);
+  }
+  imagefile = argv[optind];
+}
+
+int bench_callback(const zone_span *span, void *user) {
+  bench_sink *sink = (bench_sink *)user;
+  sink->spans++;
+  sink->bytes += span->length;
+  sink->check += (uint64_t)span->image_off ^ span->file_off;
+  return 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / NSEC;
+}
+
+/* the whole image behind a memory stream, so pointer tables come from
+   memory and the timing is the walk rather than the disk or syscalls */
+static FILE *load_image(const char *path, uint8_t **data) {
+  FILE *f = fopen(path, "r");
+  FILE *mem;
+  size_t cap = 1 << 20;
+  size_t len = 0;
+  size_t got;
+
+  if (f == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+  *data = NULL;
+  do {
+    if (*data == NULL || len == cap) {
+      cap = *data == NULL ? cap : cap * 2;
+      *data = (uint8_t *)realloc(*data, cap);
+      if (*data == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    got = fread(*data + len, 1, cap - len, f);
+    len += got;
+  } while (got > 0);
+  if (ferror(f)) {
+    perror("fread");
+    exit(EXIT_FAILURE);
+  }
+  fclose(f);
+  mem = fmemopen(*data, len, "r");
+  if (mem == NULL) {
+    perror("fmemopen");
+    exit(EXIT_FAILURE);
+  }
+  return mem;
+}
+
+/* walk every file nrounds times and give back the seconds it took */
+static double run_walks(FILE *image, fs_info *fs, minix_inode *inodes,
+    uint32_t count, long nrounds, bench_sink *sink) {
+  double start;
+  long r;
+  uint32_t i;
+
+  memset(sink, 0, sizeof(*sink));
+  start = now();
+  for (r = 0; r < nrounds; r++) {
+    for (i = 0; i < count; i++) {
+      iterate_file_zones(image, fs, &inodes[i], bench_callback, sink);
+    }
+  }
+  return now() - start;
+}
+
+static void print_result(const char *name, double secs,
+    const bench_sink *sink) {
+  printf("  %-12s %10.4f s %10.2f ns/span %12.0f spans/s\n", name, secs,
+      sink->spans ? secs * NSEC / sink->spans : 0.0,
+      secs > 0 ? sink->spans / secs : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+  FILE *image = NULL;
+  uint8_t *data;
+  fs_info fs;
+  fs_info generic;
+  minix_inode *inodes;
+  uint32_t count = 0;
+  uint32_t ino;
+  bench_sink fast_sink;
+  bench_sink slow_sink;
+  double fast_secs = 0;
+  double slow_secs = 0;
+  long t;
+
+  parse_options(argc, argv);
+
+  image = load_image(imagefile, &data);
+  init_fs(image, &fs, primary, subpart);
+  if (verbose) {
+    print_superblock(&fs);
+  }
+
+  /* keep every in-use inode in memory so only the walk gets timed */
+  inodes = (minix_inode *)malloc((size_t)fs.sb.ninodes *
+      sizeof(minix_inode));
+  if (inodes == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (ino = 1; ino <= fs.sb.ninodes; ino++) {
+    if (read_inode(image, &fs, ino, &inodes[count]) != 0) {
+      exit(EXIT_FAILURE);
+    }
+    if (inodes[count].mode != 0 && inodes[count].links != 0) {
+      count++;
+    }
+  }
+
+  /* same image with the specialized walk turned off */
+  generic = fs;
+  generic.fast_path = -1;
+
+  /* one untimed pass each, checked against each other before timing */
+  run_walks(image, &generic, inodes, count, 1, &slow_sink);
+  run_walks(image, &fs, inodes, count, 1, &fast_sink);
+  if (slow_sink.spans != fast_sink.spans ||
+      slow_sink.bytes != fast_sink.bytes ||
+      slow_sink.check != fast_sink.check) {
+    fprintf(stderr, "minbench: walks disagree, not timing them.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* alternate the two and keep each one's best trial, so a noisy
+     moment hurts neither side */
+  for (t = 0; t < trials; t++) {
+    double secs = run_walks(image, &generic, inodes, count, rounds,
+        &slow_sink);
+    if (t == 0 || secs < slow_secs) {
+      slow_secs = secs;
+    }
+    secs = run_walks(image, &fs, inodes, count, rounds, &fast_sink);
+    if (t == 0 || secs < fast_secs) {
+      fast_secs = secs;
+    }
+  }
+
+  printf("%u files, best of %ld trials of %ld rounds, %llu spans per walk, "
+      "fast path %d\n", count, trials, rounds,
+      (unsigned long long)(fast_sink.spans / rounds), fs.fast_path);
+  print_result("generic", slow_secs, &slow_sink);
+  print_result("specialized", fast_secs, &fast_sink);
+  if (fast_secs > 0) {
+    printf("  speedup      %10.2fx\n", slow_secs / fast_secs);
+  }
+
+  free(inodes);
+  if (fclose(image) != 0) {
+    perror("fclose");
+    exit(EXIT_FAILURE);
+  }
+  free(data);
+  return 0;
+}
@@ -0,0 +1,410 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fnmatch.h>
+#include "minfs_common.h"
+#include "min.h"
+
+#define BASE 10
+#define MAXPART 3
+#define MINPART 0
+
+#define DIRENT_NAME_SIZE 60
+
+/* inode table blocks read per readinto */
+#define ITABLE_CHUNK 64
+
+/* most bytes one sweep read pulls in when zones sit back to back */
+#define SWEEP_MAX (1024 * 1024)
+
+#define NO_NAME UINT32_MAX
+
+/* deepest directory chain a path is rebuilt through */
+#define PATH_MAX_DEPTH 1024
+#define PATH_BUF 4096
+
+#define USAGE "usage: minfind [ -v ] [ -p num [ -s num ] ] imagefile " \
+  "pattern\n"
+
+/* a directory zone waiting for the sweep */
+typedef struct {
+  off_t    off;
+  uint32_t length;
+  uint32_t dir;
+} dir_span;
+
+/* a name that matched, resolved to a path at the end */
+typedef struct {
+  uint32_t dir;
+  uint32_t name;
+} match;
+
+typedef struct {
+  fs_info *fs;
+  FILE *image;
+  const char *pattern;
+  uint16_t *modes;
+  uint32_t *parent;
+  uint32_t *dir_name;
+  dir_span *spans;
+  size_t nspans;
+  size_t spans_cap;
+  match *matches;
+  size_t nmatches;
+  size_t matches_cap;
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+  uint32_t cur_dir;
+} find_state;
+
+static int verbose = 0;
+static int primary = -1;
+static int subpart = -1;
+const char *imagefile = NULL;
+const char *pattern = NULL;
+
+/* parse command line arguments */
+void parse_options(int argc, char *argv[]) {
+  int opt;
+  char *end;
+
+  while ((opt = getopt(argc, argv, "vp:s:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'p':
+        primary = strtol(optarg, &end, BASE);
+        if (end == optarg || errno == ERANGE) {
+          fprintf(stderr, "-p usage: p <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        if (primary > MAXPART || primary < MINPART) {
+          fprintf(stderr,
+            "Partition %d out of range.  Must be 0..3.\n", primary);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 's':
+        subpart = strtol(optarg, &end, BASE);
+        if (end == optarg || errno == ERANGE) {
+          fprintf(stderr, "-s usage: s <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        if (subpart > MAXPART || subpart < MINPART) {
+          fprintf(stderr,
+            "Partition %d out of range.  Must be 0..3.\n", subpart);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  /* subpartition requires a primary partition */
+  if (subpart != -1 && primary == -1) {
+    fprintf(stderr, "usage: -s requires -p\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (argc - optind != 2) {
+    fprintf(stderr, USAGE);
+    exit(EXIT_FAILURE);
+  }
+  imagefile = argv[optind];
+  pattern = argv[optind + 1];
+
+  if (verbose) {
+    printf("verbose:\n");
+    printf("imagefile: %s\n", imagefile);
+    printf("pattern: %s\n", pattern);
+    printf("partition: %d\n", primary);
+    printf("subpartition: %d\n", subpart);
+  }
+}
+
+static void *xrealloc(void *p, size_t size) {
+  void *q = realloc(p, size);
+  if (q == NULL) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  return q;
+}
+
+static uint32_t add_name(find_state *s, const char *name, size_t len) {
+  uint32_t at = (uint32_t)s->names_len;
+  if (s->names_len + len + 1 > s->names_cap) {
+    s->names_cap = (s->names_cap + len + 1) * 2;
+    s->names = (char *)xrealloc(s->names, s->names_cap);
+  }
+  memcpy(s->names + s->names_len, name, len);
+  s->names[s->names_len + len] = '\0';
+  s->names_len += len + 1;
+  return at;
+}
+
+/* remember where a directory's zones are, nothing is read yet */
+int gather_zone_callback(const zone_span *span, void *user) {
+  find_state *s = (find_state *)user;
+  dir_span *d;
+
+  if (span->is_hole) {
+    return 0;
+  }
+  if (s->nspans == s->spans_cap) {
+    s->spans_cap = s->spans_cap ? s->spans_cap * 2 : 256;
+    s->spans = (dir_span *)xrealloc(s->spans,
+        s->spans_cap * sizeof(dir_span));
+  }
+  d = &s->spans[s->nspans++];
+  d->off = span->image_off;
+  d->length = span->length;
+  d->dir = s->cur_dir;
+  return 0;
+}
+
+/* read the inode table front to back and queue the zones of every
+   directory in it */
+static void scan_inodes(find_state *s) {
+  fs_info *fs = s->fs;
+  uint32_t per_chunk = fs->ino_per_block * ITABLE_CHUNK;
+  minix_inode *chunk;
+  uint32_t first;
+  uint32_t ndirs = 0;
+
+  chunk = (minix_inode *)malloc((size_t)per_chunk * sizeof(minix_inode));
+  if (chunk == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (first = 1; first <= fs->sb.ninodes; first += per_chunk) {
+    uint32_t count = fs->sb.ninodes - first + 1;
+    uint32_t i;
+    if (count > per_chunk) {
+      count = per_chunk;
+    }
+    trace_kind(TRACE_INODE);
+    readinto(chunk, get_inode_offset((int)first, fs),
+        (size_t)count * sizeof(minix_inode), s->image, NULL);
+    for (i = 0; i < count; i++) {
+      minix_inode *in = &chunk[i];
+      fix_inode(fs, in);
+      if (in->links == 0) {
+        continue;
+      }
+      s->modes[first + i] = in->mode;
+      if ((in->mode & FILEMASK) == DIRECTORY) {
+        s->cur_dir = first + i;
+        iterate_file_zones(s->image, fs, in, gather_zone_callback, s);
+        ndirs++;
+      }
+    }
+  }
+  free(chunk);
+  if (verbose) {
+    printf("verbose: %u directories, %zu zones to sweep\n", ndirs,
+        s->nspans);
+  }
+}
+
+static int cmp_span(const void *a, const void *b) {
+  const dir_span *x = (const dir_span *)a;
+  const dir_span *y = (const dir_span *)b;
+  return (x->off > y->off) - (x->off < y->off);
+}
+
+static void scan_entries(find_state *s, const dir_span *d,
+    uint8_t *buf) {
+  uint32_t n = d->length / sizeof(minix_dirent);
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    minix_dirent entry;
+    size_t len;
+    char name[SAFE_NAME_SIZE];
+
+    memcpy(&entry, buf + i * sizeof(minix_dirent), sizeof(entry));
+    fix_dirent(s->fs, &entry);
+    if (entry.inode == 0 || entry.inode > s->fs->sb.ninodes) {
+      continue;
+    }
+    len = strnlen(entry.name, DIRENT_NAME_SIZE);
+    memcpy(name, entry.name, len);
+    name[len] = '\0';
+    if (strcmp(name, ".") == 0) {
+      continue;
+    }
+    if (strcmp(name, "..") == 0) {
+      s->parent[d->dir] = entry.inode;
+      continue;
+    }
+    if ((s->modes[entry.inode] & FILEMASK) == DIRECTORY &&
+        s->dir_name[entry.inode] == NO_NAME) {
+      s->dir_name[entry.inode] = add_name(s, name, len);
+    }
+    if (fnmatch(s->pattern, name, 0) == 0) {
+      match *m;
+      if (s->nmatches == s->matches_cap) {
+        s->matches_cap = s->matches_cap ? s->matches_cap * 2 : 64;
+        s->matches = (match *)xrealloc(s->matches,
+            s->matches_cap * sizeof(match));
+      }
+      m = &s->matches[s->nmatches++];
+      m->dir = d->dir;
+      m->name = add_name(s, name, len);
+    }
+  }
+}
+
+/* one pass over the directory zones in disk order. zones that sit back
+   to back are read together */
+static void sweep(find_state *s) {
+  uint8_t *buf = (uint8_t *)malloc(SWEEP_MAX + s->fs->zonesize);
+  size_t i = 0;
+  size_t reads = 0;
+
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  qsort(s->spans, s->nspans, sizeof(dir_span), cmp_span);
+  while (i < s->nspans) {
+    off_t start = s->spans[i].off;
+    off_t end = start + s->spans[i].length;
+    size_t j = i + 1;
+    size_t k;
+    while (j < s->nspans && s->spans[j].off == end &&
+        end - start + s->spans[j].length <= SWEEP_MAX) {
+      end += s->spans[j].length;
+      j++;
+    }
+    trace_kind(TRACE_DIRENT);
+    readinto(buf, start, (size_t)(end - start), s->image, NULL);
+    reads++;
+    for (k = i; k < j; k++) {
+      scan_entries(s, &s->spans[k], buf + (s->spans[k].off - start));
+    }
+    i = j;
+  }
+  free(buf);
+  if (verbose) {
+    printf("verbose: swept %zu zones in %zu reads\n", s->nspans, reads);
+  }
+}
+
+/* put a directory's path together by following .. up to the root */
+static size_t dir_path(const find_state *s, uint32_t dir, char *out,
+    size_t cap) {
+  uint32_t chain[PATH_MAX_DEPTH];
+  size_t depth = 0;
+  size_t len = 0;
+
+  while (dir != 1 && depth < PATH_MAX_DEPTH) {
+    chain[depth++] = dir;
+    dir = s->parent[dir];
+    if (dir == 0) {
+      break;
+    }
+  }
+  if (dir != 1) {
+    len = (size_t)snprintf(out, cap, "?");
+  }
+  while (depth > 0 && len < cap) {
+    uint32_t d = chain[--depth];
+    const char *name = s->dir_name[d] == NO_NAME ? "?" :
+        s->names + s->dir_name[d];
+    len += (size_t)snprintf(out + len, cap - len, "/%s", name);
+  }
+  return len < cap ? len : cap - 1;
+}
+
+static int cmp_path(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void print_matches(find_state *s) {
+  char **paths;
+  char buf[PATH_BUF];
+  size_t i;
+
+  paths = (char **)malloc((s->nmatches + 1) * sizeof(char *));
+  if (paths == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < s->nmatches; i++) {
+    size_t len = dir_path(s, s->matches[i].dir, buf, sizeof(buf));
+    snprintf(buf + len, sizeof(buf) - len, "/%s",
+        s->names + s->matches[i].name);
+    paths[i] = strdup(buf);
+    if (paths[i] == NULL) {
+      perror("strdup");
+      exit(EXIT_FAILURE);
+    }
+  }
+  qsort(paths, s->nmatches, sizeof(char *), cmp_path);
+  for (i = 0; i < s->nmatches; i++) {
+    if (printf("%s\n", paths[i]) < 0) {
+      perror("printf");
+      exit(EXIT_FAILURE);
+    }
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+int main(int argc, char *argv[]) {
+  FILE *image = NULL;
+  fs_info fs;
+  find_state s;
+  size_t slots;
+
+  parse_options(argc, argv);
+
+  image = fopen(imagefile, "r");
+  if (image == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+  init_fs(image, &fs, primary, subpart);
+  if (verbose) {
+    print_superblock(&fs);
+  }
+
+  memset(&s, 0, sizeof(s));
+  s.fs = &fs;
+  s.image = image;
+  s.pattern = pattern;
+  slots = (size_t)fs.sb.ninodes + 1;
+  s.modes = (uint16_t *)calloc(slots, sizeof(uint16_t));
+  s.parent = (uint32_t *)calloc(slots, sizeof(uint32_t));
+  s.dir_name = (uint32_t *)malloc(slots * sizeof(uint32_t));
+  if (s.modes == NULL || s.parent == NULL || s.dir_name == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(s.dir_name, 0xff, slots * sizeof(uint32_t));
+
+  scan_inodes(&s);
+  sweep(&s);
+  print_matches(&s);
+
+  free(s.modes);
+  free(s.parent);
+  free(s.dir_name);
+  free(s.spans);
+  free(s.matches);
+  free(s.names);
+  if (fclose(image) != 0) {
+    perror("fclose");
+    exit(EXIT_FAILURE);
+  }
+  return s.nmatches ? 0 : EXIT_FAILURE;
+}
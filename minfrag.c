@@ -0,0 +1,452 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "minfs_common.h"
+#include "min.h"
+
+#define BASE 10
+#define MAXPART 3
+#define MINPART 0
+
+#define DEFAULT_WORST 10
+#define MAX_THREADS 64
+
+/* inodes handed to a worker at a time, read with one readinto */
+#define INODE_CHUNK 256
+
+/* a double indirect top and its first leaf can sit between two zones */
+#define MAX_TABLE_GAP 2
+
+/* extent count buckets are powers of two: 1, 2, 3-4, 5-8, ... */
+#define HIST_BUCKETS 17
+
+#define USAGE "usage: minfrag [ -v ] [ -a ] [ -n worst ] [ -j threads ] " \
+  "[ -p num [ -s num ] ] imagefile\n"
+
+/* what one file looks like on disk */
+typedef struct {
+  uint32_t ino;
+  uint16_t mode;
+  uint32_t size;
+  uint32_t zones;
+  uint32_t extents;
+  uint32_t tables;
+  uint64_t hole_bytes;
+} file_frag;
+
+/* running state while walking the zones of one file */
+typedef struct {
+  file_frag *out;
+  uint32_t last_zone;
+  uint32_t *tables;
+  uint32_t ntables;
+} frag_context;
+
+typedef struct {
+  fs_info *fs;
+  file_frag *files;
+  uint32_t next_ino;
+  uint32_t used;
+} frag_job;
+
+static int verbose = 0;
+static int primary = -1;
+static int subpart = -1;
+static int show_all = 0;
+static int worst = DEFAULT_WORST;
+static int nthreads = 0;
+const char *imagefile = NULL;
+
+/* parse command line arguments */
+void parse_options(int argc, char *argv[]) {
+  int opt;
+  char *end;
+
+  while ((opt = getopt(argc, argv, "vap:s:n:j:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'a':
+        show_all = 1;
+        break;
+      case 'n':
+        worst = strtol(optarg, &end, BASE);
+        if (end == optarg || *end != '\0' || worst < 0) {
+          fprintf(stderr, "-n usage: n <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'j':
+        nthreads = strtol(optarg, &end, BASE);
+        if (end == optarg || *end != '\0' || nthreads < 1 ||
+            nthreads > MAX_THREADS) {
+          fprintf(stderr, "-j usage: j <1..%d>\n", MAX_THREADS);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'p':
+        primary = strtol(optarg, &end, BASE);
+        if (end == optarg || errno == ERANGE) {
+          fprintf(stderr, "-p usage: p <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        if (primary > MAXPART || primary < MINPART) {
+          fprintf(stderr,
+            "Partition %d out of range.  Must be 0..3.\n", primary);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 's':
+        subpart = strtol(optarg, &end, BASE);
+        if (end == optarg || errno == ERANGE) {
+          fprintf(stderr, "-s usage: s <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        if (subpart > MAXPART || subpart < MINPART) {
+          fprintf(stderr,
+            "Partition %d out of range.  Must be 0..3.\n", subpart);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  /* subpartition requires a primary partition */
+  if (subpart != -1 && primary == -1) {
+    fprintf(stderr, "usage: -s requires -p\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (argc - optind != 1) {
+    fprintf(stderr, USAGE);
+    exit(EXIT_FAILURE);
+  }
+  imagefile = argv[optind];
+
+  if (nthreads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = cpus < 1 ? 1 : (cpus > MAX_THREADS ? MAX_THREADS : cpus);
+  }
+
+  if (verbose) {
+    printf("verbose:\n");
+    printf("imagefile: %s\n", imagefile);
+    printf("partition: %d\n", primary);
+    printf("subpartition: %d\n", subpart);
+    printf("threads: %d\n", nthreads);
+  }
+}
+
+static int cmp_zone(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* true when every zone strictly between from and to is one of this
+   file's own pointer tables, which a reader goes through anyway */
+static int only_tables_between(const frag_context *ctx, uint32_t from,
+    uint32_t to) {
+  uint32_t z;
+  for (z = from + 1; z < to; z++) {
+    if (!bsearch(&z, ctx->tables, ctx->ntables, sizeof(uint32_t),
+          cmp_zone)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int frag_zone_callback(const zone_span *span, void *user) {
+  frag_context *ctx = (frag_context *)user;
+  file_frag *f = ctx->out;
+
+  if (span->is_hole) {
+    f->hole_bytes += span->length;
+    ctx->last_zone = 0;
+    return 0;
+  }
+  f->zones++;
+  if (ctx->last_zone == 0 || span->zone <= ctx->last_zone ||
+      span->zone - ctx->last_zone > 1 + MAX_TABLE_GAP ||
+      !only_tables_between(ctx, ctx->last_zone, span->zone)) {
+    f->extents++;
+  }
+  ctx->last_zone = span->zone;
+  return 0;
+}
+
+/* collect the pointer table zones of a file, only metadata is read */
+static uint32_t gather_tables(FILE *image, fs_info *fs,
+    const minix_inode *in, uint32_t *tables) {
+  uint32_t n = 0;
+  uint32_t i;
+
+  if (in->indirect != 0) {
+    tables[n++] = in->indirect;
+  }
+  if (in->two_indirect != 0) {
+    uint32_t *top = (uint32_t *)malloc(fs->sb.blocksize);
+    if (top == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    tables[n++] = in->two_indirect;
+    trace_kind(TRACE_INDIRECT);
+    readinto(top, (off_t)in->two_indirect * fs->zonesize,
+        fs->sb.blocksize, image, NULL);
+    fix_table(fs, top, fs->ptrs_per_blk);
+    for (i = 0; i < fs->ptrs_per_blk; i++) {
+      if (top[i] != 0) {
+        tables[n++] = top[i];
+      }
+    }
+    free(top);
+  }
+  qsort(tables, n, sizeof(uint32_t), cmp_zone);
+  return n;
+}
+
+/* each worker has its own FILE* since readinto seeks, and pulls chunks
+   of the inode table until there are none left */
+static void *frag_worker(void *arg) {
+  frag_job *job = (frag_job *)arg;
+  fs_info *fs = job->fs;
+  minix_inode *chunk;
+  uint32_t *tables;
+  FILE *image;
+  frag_context ctx;
+
+  image = fopen(imagefile, "r");
+  if (image == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+  chunk = (minix_inode *)malloc(INODE_CHUNK * sizeof(minix_inode));
+  tables = (uint32_t *)malloc((2 + fs->ptrs_per_blk) * sizeof(uint32_t));
+  if (chunk == NULL || tables == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    uint32_t first = __atomic_fetch_add(&job->next_ino, INODE_CHUNK,
+        __ATOMIC_RELAXED);
+    uint32_t count;
+    uint32_t i;
+    if (first > fs->sb.ninodes) {
+      break;
+    }
+    count = fs->sb.ninodes - first + 1;
+    if (count > INODE_CHUNK) {
+      count = INODE_CHUNK;
+    }
+    trace_kind(TRACE_INODE);
+    readinto(chunk, get_inode_offset((int)first, fs),
+        count * sizeof(minix_inode), image, NULL);
+
+    for (i = 0; i < count; i++) {
+      minix_inode *in = &chunk[i];
+      file_frag *f = &job->files[first + i];
+      fix_inode(fs, in);
+      if (in->mode == 0 || in->links == 0) {
+        continue;
+      }
+      f->ino = first + i;
+      f->mode = in->mode;
+      f->size = in->size;
+      ctx.out = f;
+      ctx.last_zone = 0;
+      ctx.tables = tables;
+      ctx.ntables = gather_tables(image, fs, in, tables);
+      f->tables = ctx.ntables;
+      iterate_file_zones(image, fs, in, frag_zone_callback, &ctx);
+      __atomic_fetch_add(&job->used, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  free(tables);
+  free(chunk);
+  fclose(image);
+  return NULL;
+}
+
+static int hist_bucket(uint32_t extents) {
+  int b = 0;
+  uint32_t top = 1;
+  while (top < extents && b < HIST_BUCKETS - 1) {
+    top <<= 1;
+    b++;
+  }
+  return b;
+}
+
+/* most extents first, bigger files break ties */
+static int cmp_worst(const void *a, const void *b) {
+  const file_frag *x = (const file_frag *)a;
+  const file_frag *y = (const file_frag *)b;
+  if (x->extents != y->extents) {
+    return x->extents < y->extents ? 1 : -1;
+  }
+  if (x->size != y->size) {
+    return x->size < y->size ? 1 : -1;
+  }
+  return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+static void print_file_frag(const file_frag *f) {
+  double avg = f->extents ? (double)f->zones / f->extents : 0.0;
+  double holes = f->size ? 100.0 * f->hole_bytes / f->size : 0.0;
+  char type = (f->mode & FILEMASK) == DIRECTORY ? 'd' : '-';
+  if (printf("  %8u %c %10u %8u %8u %9.2f %7.2f%% %7u\n", f->ino, type,
+        f->size, f->zones, f->extents, avg, holes, f->tables) < 0) {
+    perror("printf");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void print_header(void) {
+  printf("  %8s %c %10s %8s %8s %9s %8s %7s\n", "inode", 't', "size",
+      "zones", "extents", "avg_ext", "holes", "tables");
+}
+
+static void print_report(file_frag *files, uint32_t nfiles) {
+  uint64_t hist[HIST_BUCKETS];
+  uint64_t zones = 0;
+  uint64_t extents = 0;
+  uint64_t tables = 0;
+  uint64_t bytes = 0;
+  uint64_t holes = 0;
+  uint32_t fragmented = 0;
+  uint32_t i;
+  int b;
+
+  memset(hist, 0, sizeof(hist));
+  for (i = 0; i < nfiles; i++) {
+    zones += files[i].zones;
+    extents += files[i].extents;
+    tables += files[i].tables;
+    bytes += files[i].size;
+    holes += files[i].hole_bytes;
+    if (files[i].extents > 1) {
+      fragmented++;
+    }
+    if (files[i].extents > 0) {
+      hist[hist_bucket(files[i].extents)]++;
+    }
+  }
+
+  printf("Image:\n");
+  printf("  files            = %10u\n", nfiles);
+  printf("  fragmented       = %10u (%.2f%%)\n", fragmented,
+      nfiles ? 100.0 * fragmented / nfiles : 0.0);
+  printf("  data zones       = %10llu\n", (unsigned long long)zones);
+  printf("  extents          = %10llu\n", (unsigned long long)extents);
+  printf("  avg extent       = %10.2f zones\n",
+      extents ? (double)zones / extents : 0.0);
+  printf("  holes            = %9.2f%%\n",
+      bytes ? 100.0 * holes / bytes : 0.0);
+  printf("  pointer tables   = %10llu (%.2f%% of data zones)\n",
+      (unsigned long long)tables, zones ? 100.0 * tables / zones : 0.0);
+
+  printf("Extents per file:\n");
+  for (b = 0; b < HIST_BUCKETS; b++) {
+    uint32_t lo = b == 0 ? 1 : (1u << (b - 1)) + 1;
+    uint32_t hi = 1u << b;
+    if (hist[b] == 0) {
+      continue;
+    }
+    if (b == HIST_BUCKETS - 1) {
+      printf("  %7u+        %10llu\n", lo, (unsigned long long)hist[b]);
+    } else if (lo == hi) {
+      printf("  %7u         %10llu\n", lo, (unsigned long long)hist[b]);
+    } else {
+      printf("  %7u-%-7u %10llu\n", lo, hi, (unsigned long long)hist[b]);
+    }
+  }
+
+  qsort(files, nfiles, sizeof(file_frag), cmp_worst);
+  if (worst > 0) {
+    printf("Worst %d files:\n", worst);
+    print_header();
+    for (i = 0; i < nfiles && i < (uint32_t)worst; i++) {
+      print_file_frag(&files[i]);
+    }
+  }
+  if (show_all) {
+    printf("All files:\n");
+    print_header();
+    for (i = 0; i < nfiles; i++) {
+      print_file_frag(&files[i]);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  FILE *image = NULL;
+  fs_info fs;
+  frag_job job;
+  pthread_t threads[MAX_THREADS];
+  uint32_t n = 0;
+  uint32_t i;
+  int t;
+
+  parse_options(argc, argv);
+
+  image = fopen(imagefile, "r");
+  if (image == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+  init_fs(image, &fs, primary, subpart);
+  if (verbose) {
+    print_superblock(&fs);
+  }
+  if (fclose(image) != 0) {
+    perror("fclose");
+    exit(EXIT_FAILURE);
+  }
+
+  /* slot per inode so workers never share anything but the counter */
+  job.fs = &fs;
+  job.next_ino = 1;
+  job.used = 0;
+  job.files = (file_frag *)calloc((size_t)fs.sb.ninodes + 1,
+      sizeof(file_frag));
+  if (job.files == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (t = 0; t < nthreads; t++) {
+    if (pthread_create(&threads[t], NULL, frag_worker, &job) != 0) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  /* squeeze the used inodes to the front */
+  for (i = 1; i <= fs.sb.ninodes; i++) {
+    if (job.files[i].ino != 0) {
+      job.files[n++] = job.files[i];
+    }
+  }
+  if (verbose) {
+    printf("verbose: %u inodes in use\n", job.used);
+  }
+
+  print_report(job.files, n);
+  free(job.files);
+  return 0;
+}
@@ -4,12 +4,20 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include "min.h"
 #include "minfs_common.h"
 
 off_t fs_start = 0;
 off_t fs_end;
 
+/* records are only made while trace_out is open, so an untraced run
+   pays one branch per read */
+static FILE *trace_out = NULL;
+static __thread int trace_cur = TRACE_OTHER;
+
+#define TRACE_BUFSIZE (1024 * 1024)
+
 typedef struct {
   FILE *image;
   fs_info *fs;
@@ -18,6 +26,111 @@ typedef struct {
   int found;
 } search_context;
 
+/* pick the widest byte swap the compiler lets us use */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*byte swap a table of 32 bit words in place. indirect blocks and bitmap
+  blocks of an opposite endian image go through here a whole block at a
+  time*/
+void swap_table32(uint32_t *tbl, size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i rev = _mm256_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(tbl + i));
+    _mm256_storeu_si256((__m256i *)(tbl + i), _mm256_shuffle_epi8(v, rev));
+  }
+#elif defined(__SSSE3__)
+  const __m128i rev = _mm_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(tbl + i));
+    _mm_storeu_si128((__m128i *)(tbl + i), _mm_shuffle_epi8(v, rev));
+  }
+#elif defined(__SSE2__)
+  /*no byte shuffle here, so swap the bytes of each half and then the
+    halves of each word*/
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(tbl + i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, 0xB1);
+    v = _mm_shufflehi_epi16(v, 0xB1);
+    _mm_storeu_si128((__m128i *)(tbl + i), v);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 4 <= n; i += 4) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)(tbl + i));
+    vst1q_u8((uint8_t *)(tbl + i), vrev32q_u8(v));
+  }
+#endif
+  for (; i < n; i++) {
+    tbl[i] = __builtin_bswap32(tbl[i]);
+  }
+}
+
+static void swap_superblock(superblock *sb) {
+  sb->ninodes = __builtin_bswap32(sb->ninodes);
+  sb->pad1 = __builtin_bswap16(sb->pad1);
+  sb->i_blocks = (int16_t)__builtin_bswap16((uint16_t)sb->i_blocks);
+  sb->z_blocks = (int16_t)__builtin_bswap16((uint16_t)sb->z_blocks);
+  sb->firstdata = __builtin_bswap16(sb->firstdata);
+  sb->log_zone_size =
+      (int16_t)__builtin_bswap16((uint16_t)sb->log_zone_size);
+  sb->pad2 = (int16_t)__builtin_bswap16((uint16_t)sb->pad2);
+  sb->max_file = __builtin_bswap32(sb->max_file);
+  sb->zones = __builtin_bswap32(sb->zones);
+  sb->magic = (int16_t)__builtin_bswap16((uint16_t)sb->magic);
+  sb->pad3 = (int16_t)__builtin_bswap16((uint16_t)sb->pad3);
+  sb->blocksize = __builtin_bswap16(sb->blocksize);
+}
+
+/*turn an inode between disk and host order. swapping is its own
+  inverse, so this works for reading and for writing*/
+void fix_inode(const fs_info *fs, minix_inode *in) {
+  int i;
+  if (!fs->swapped) {
+    return;
+  }
+  in->mode = __builtin_bswap16(in->mode);
+  in->links = __builtin_bswap16(in->links);
+  in->uid = __builtin_bswap16(in->uid);
+  in->gid = __builtin_bswap16(in->gid);
+  in->size = __builtin_bswap32(in->size);
+  in->atime = (int32_t)__builtin_bswap32((uint32_t)in->atime);
+  in->mtime = (int32_t)__builtin_bswap32((uint32_t)in->mtime);
+  in->ctime = (int32_t)__builtin_bswap32((uint32_t)in->ctime);
+  for (i = 0; i < DIRECT_ZONES; i++) {
+    in->zone[i] = __builtin_bswap32(in->zone[i]);
+  }
+  in->indirect = __builtin_bswap32(in->indirect);
+  in->two_indirect = __builtin_bswap32(in->two_indirect);
+  in->unused = __builtin_bswap32(in->unused);
+}
+
+/*only the inode number needs it, names are plain bytes*/
+void fix_dirent(const fs_info *fs, minix_dirent *d) {
+  if (fs->swapped) {
+    d->inode = __builtin_bswap32(d->inode);
+  }
+}
+
+/*pointer tables and bitmaps are arrays of 32 bit words on disk*/
+void fix_table(const fs_info *fs, uint32_t *tbl, size_t n) {
+  if (fs->swapped) {
+    swap_table32(tbl, n);
+  }
+}
+
 void print_superblock(fs_info *fs) {
   printf("Superblock:\n");
   printf("  On disk:\n");
@@ -38,6 +151,8 @@ void print_superblock(fs_info *fs) {
   printf("    ptrs_per_blk   = %10u\n", fs->ptrs_per_blk);
   printf("    links_per_zone = %10u\n", fs->links_per_zone);
   printf("    ino_per_block  = %10u\n", fs->ino_per_block);
+  printf("    swapped        = %10d\n", fs->swapped);
+  printf("    fast_path      = %10d\n", fs->fast_path);
 }
 
 static inline int set_zone_traits(zone_visit_fn cb, void *user,
@@ -56,11 +171,31 @@ static inline int set_zone_traits(zone_visit_fn cb, void *user,
   return cb(&span, user);
 }
 
+/*pointer tables are read from inside the walk, where the caller's kind
+  is still set*/
+static inline void read_indirect(void *tbl, off_t off, size_t bytes,
+    FILE *image) {
+  int old = trace_kind(TRACE_INDIRECT);
+  readinto(tbl, off, bytes, image, NULL);
+  trace_kind(old);
+}
+
+/*pull one pointer table in. swapped is a constant in every caller, so
+  the native walk compiles without any trace of the conversion*/
+static inline __attribute__((always_inline)) void read_table(FILE *image,
+    fs_info *fs, uint32_t zone, uint32_t *tbl, const int swapped) {
+  read_indirect(tbl, (off_t)zone * (off_t)fs->zonesize, fs->sb.blocksize,
+      image);
+  if (swapped) {
+    swap_table32(tbl, fs->ptrs_per_blk);
+  }
+}
+
 /*adding functionality that you have in minls as shared stuff
   and changing a bit */
-int iterate_file_zones(FILE *image, fs_info *fs, const minix_inode *in,
-    zone_visit_fn cb, void *user) {
-  (void)image;
+static inline __attribute__((always_inline)) int walk_file_zones(
+    FILE *image, fs_info *fs, const minix_inode *in, zone_visit_fn cb,
+    void *user, const int swapped) {
   const uint64_t fsize = in->size;
   const uint32_t zonesize = fs->zonesize;
   const uint32_t ptrs_per_blk = fs->ptrs_per_blk;
@@ -93,8 +228,6 @@ int iterate_file_zones(FILE *image, fs_info *fs, const minix_inode *in,
   /*only one indirect block to check, array of zone nums*/
   /*if still bytes in file and interect, cont.*/
   if (produced < fsize && in->indirect != 0) {
-    uint32_t table_zone = in->indirect;
-    off_t off = (off_t)table_zone * (off_t)zonesize;
     /*read first blcok and pull out the ptrs*/
     /*allocate a buffer the size of 1 block*/
     uint32_t *ptrs = (uint32_t*)malloc(fs->sb.blocksize);
@@ -102,7 +235,7 @@ int iterate_file_zones(FILE *image, fs_info *fs, const minix_inode *in,
       perror("malloc");
       exit(EXIT_FAILURE);
     }
-    readinto(ptrs, off, fs->sb.blocksize, image, NULL);
+    read_table(image, fs, in->indirect, ptrs, swapped);
     /*a loop kinda like direct block to return zone structs*/
     for (j = 0; j < ptrs_per_blk && produced < fsize; j++) {
       uint32_t z = ptrs[j];
@@ -126,15 +259,13 @@ int iterate_file_zones(FILE *image, fs_info *fs, const minix_inode *in,
   /*double indirect block handling*/
   /*check if there is data and if double exists*/
   if (produced < fsize && in->two_indirect != 0) {
-    uint32_t top_zone = in->two_indirect;
-    off_t top_off = (off_t)top_zone * (off_t)zonesize;
     /*just like single indirect, allocate memory of 1 block*/
     uint32_t *top = (uint32_t*)malloc(fs->sb.blocksize);
     if (!top) {
       perror("malloc");
       exit(EXIT_FAILURE);
     }
-    readinto(top, top_off, fs->sb.blocksize, image, NULL);
+    read_table(image, fs, in->two_indirect, top, swapped);
     for (f = 0; f < ptrs_per_blk && produced < fsize; f++) {
       uint32_t second_zone = top[f];
       /*check if second zone is holes*/
@@ -156,17 +287,16 @@ int iterate_file_zones(FILE *image, fs_info *fs, const minix_inode *in,
         }
         continue;
       }
-      off_t leaf_off = (off_t)second_zone * (off_t)zonesize;
       uint32_t *leaf = (uint32_t*)malloc(fs->sb.blocksize);
       if (!leaf) {
         free(top);
         perror("malloc");
         exit(EXIT_FAILURE);
       }
-      readinto(leaf, leaf_off, fs->sb.blocksize, image, NULL);
+      read_table(image, fs, second_zone, leaf, swapped);
       /*a loop kinda like direct block to return zone structs*/
-      for (f = 0; f < ptrs_per_blk && produced < fsize; f++) {
-        uint32_t z = leaf[f];
+      for (o = 0; o < ptrs_per_blk && produced < fsize; o++) {
+        uint32_t z = leaf[o];
         uint32_t take;
         if ((fsize - produced) < zonesize) {
           take = (uint32_t)(fsize - produced);
@@ -189,6 +319,160 @@ int iterate_file_zones(FILE *image, fs_info *fs, const minix_inode *in,
   return 0;
 }
 
+static int iterate_native(FILE *image, fs_info *fs, const minix_inode *in,
+    zone_visit_fn cb, void *user) {
+  return walk_file_zones(image, fs, in, cb, user, 0);
+}
+
+/*hand out count zones of a table. every zone but the last one of the
+  file is full, so those go out in a tight loop with no size check and
+  the partial tail is handled once after it. a NULL table is all holes*/
+static inline __attribute__((always_inline)) int emit_zones(
+    zone_visit_fn cb, void *user, const uint32_t *tbl, uint32_t count,
+    uint64_t *produced, uint64_t fsize, const uint32_t zshift) {
+  const uint32_t zonesize = 1u << zshift;
+  uint64_t off = *produced;
+  uint64_t full = (fsize - off) >> zshift;
+  uint32_t n = count < full ? count : (uint32_t)full;
+  uint32_t i;
+  int rz;
+
+#pragma GCC unroll 4
+  for (i = 0; i < n; i++) {
+    uint32_t z = tbl ? tbl[i] : 0;
+    rz = set_zone_traits(cb, user, z, (z == 0), off, zonesize, zonesize);
+    if (rz) {
+      return rz;
+    }
+    off += zonesize;
+  }
+  if (i < count && off < fsize) {
+    uint32_t z = tbl ? tbl[i] : 0;
+    uint32_t take = (uint32_t)(fsize - off);
+    rz = set_zone_traits(cb, user, z, (z == 0), off, take, zonesize);
+    if (rz) {
+      return rz;
+    }
+    off += take;
+  }
+  *produced = off;
+  return 0;
+}
+
+/*same walk as walk_file_zones with the block size and zone shift baked
+  in, so every multiply and divide by them turns into a shift or mask
+  and the tables live on the stack instead of the heap*/
+static inline __attribute__((always_inline)) int walk_fast(FILE *image,
+    const minix_inode *in, zone_visit_fn cb, void *user,
+    const uint32_t blocksize, const uint32_t log_zone) {
+  const uint32_t zshift = (uint32_t)__builtin_ctz(blocksize) + log_zone;
+  const uint32_t ptrs_per_blk = blocksize / sizeof(uint32_t);
+  const uint64_t fsize = in->size;
+  uint32_t direct[DIRECT_ZONES];
+  uint32_t top[FAST_MAX_BLOCK / sizeof(uint32_t)];
+  uint32_t leaf[FAST_MAX_BLOCK / sizeof(uint32_t)];
+  uint64_t produced = 0;
+  uint32_t f;
+  int rz;
+
+  if (fsize == 0) {
+    return 0;
+  }
+  memcpy(direct, in->zone, sizeof(direct));
+  rz = emit_zones(cb, user, direct, DIRECT_ZONES, &produced, fsize,
+      zshift);
+  if (rz) {
+    return rz;
+  }
+
+  if (produced < fsize && in->indirect != 0) {
+    read_indirect(leaf, (off_t)in->indirect << zshift, blocksize, image);
+    rz = emit_zones(cb, user, leaf, ptrs_per_blk, &produced, fsize,
+        zshift);
+    if (rz) {
+      return rz;
+    }
+  }
+
+  if (produced < fsize && in->two_indirect != 0) {
+    read_indirect(top, (off_t)in->two_indirect << zshift, blocksize,
+        image);
+    for (f = 0; f < ptrs_per_blk && produced < fsize; f++) {
+      const uint32_t *tbl = NULL;
+      if (top[f] != 0) {
+        read_indirect(leaf, (off_t)top[f] << zshift, blocksize, image);
+        tbl = leaf;
+      }
+      rz = emit_zones(cb, user, tbl, ptrs_per_blk, &produced, fsize,
+          zshift);
+      if (rz) {
+        return rz;
+      }
+    }
+  }
+  return 0;
+}
+
+typedef int (*zone_walk_fn)(FILE *image, const minix_inode *in,
+    zone_visit_fn cb, void *user);
+
+#define FAST_WALK(bs, lz) \
+  static int walk_##bs##_##lz(FILE *image, const minix_inode *in, \
+      zone_visit_fn cb, void *user) { \
+    return walk_fast(image, in, cb, user, bs, lz); \
+  }
+
+FAST_WALK(1024, 0) FAST_WALK(1024, 1) FAST_WALK(1024, 2) FAST_WALK(1024, 3)
+FAST_WALK(2048, 0) FAST_WALK(2048, 1) FAST_WALK(2048, 2) FAST_WALK(2048, 3)
+FAST_WALK(4096, 0) FAST_WALK(4096, 1) FAST_WALK(4096, 2) FAST_WALK(4096, 3)
+
+/*indexed by fs_info.fast_path, see pick_fast_path()*/
+static const zone_walk_fn fast_walks[FAST_PATHS] = {
+  walk_1024_0, walk_1024_1, walk_1024_2, walk_1024_3,
+  walk_2048_0, walk_2048_1, walk_2048_2, walk_2048_3,
+  walk_4096_0, walk_4096_1, walk_4096_2, walk_4096_3,
+};
+
+/*work out the shifts for this geometry and whether one of the
+  specialized walks fits it. -1 leaves the image on the generic walk*/
+static void pick_fast_path(fs_info *fs) {
+  uint32_t bs = fs->sb.blocksize;
+  int lz = fs->sb.log_zone_size;
+
+  fs->blk_shift = 0;
+  fs->zone_shift = 0;
+  fs->fast_path = -1;
+  if (bs == 0 || (bs & (bs - 1)) != 0) {
+    return;
+  }
+  fs->blk_shift = (uint32_t)__builtin_ctz(bs);
+  fs->zone_shift = fs->blk_shift + (uint32_t)lz;
+  if (fs->swapped || lz < 0 || lz > FAST_MAX_LOG_ZONE ||
+      fs->blk_shift < FAST_MIN_BLK_SHIFT ||
+      fs->blk_shift > FAST_MIN_BLK_SHIFT + 2) {
+    return;
+  }
+  fs->fast_path = (int)(fs->blk_shift - FAST_MIN_BLK_SHIFT) *
+      (FAST_MAX_LOG_ZONE + 1) + lz;
+}
+
+static int iterate_swapped(FILE *image, fs_info *fs,
+    const minix_inode *in, zone_visit_fn cb, void *user) {
+  return walk_file_zones(image, fs, in, cb, user, 1);
+}
+
+/*in has to be in host order already (read_inode takes care of that)*/
+int iterate_file_zones(FILE *image, fs_info *fs, const minix_inode *in,
+    zone_visit_fn cb, void *user) {
+  if (fs->fast_path >= 0) {
+    return fast_walks[fs->fast_path](image, in, cb, user);
+  }
+  if (fs->swapped) {
+    return iterate_swapped(image, fs, in, cb, user);
+  }
+  return iterate_native(image, fs, in, cb, user);
+}
+
 
 int search_zone_callback(const zone_span *span, void *user){
   search_context *ctx = (search_context *)user;
@@ -206,7 +490,9 @@ int search_zone_callback(const zone_span *span, void *user){
 
   for(i = 0 ; i < num_entries ; i++){
     offset = span->image_off + (i * sizeof(minix_dirent));
+    trace_kind(TRACE_DIRENT);
     readinto(&entry, offset, sizeof(entry), ctx->image, NULL);
+    fix_dirent(ctx->fs, &entry);
 
     if (entry.inode == 0){
       continue;
@@ -233,8 +519,10 @@ void resolve_path(FILE *image, fs_info *fs, minix_inode *inode,
   search_context ctx;
 
   /* root */
+  trace_kind(TRACE_INODE);
   readinto(inode, get_inode_offset(1,fs), sizeof(minix_inode), image,
       NULL);
+  fix_inode(fs, inode);
   cur_name = strtok(path_copy, "/");
 
   while (cur_name != NULL){
@@ -255,8 +543,10 @@ void resolve_path(FILE *image, fs_info *fs, minix_inode *inode,
       exit(EXIT_FAILURE);
     }
 
+    trace_kind(TRACE_INODE);
     readinto(inode, get_inode_offset(ctx.found_inode, fs),
         sizeof(minix_inode), image, NULL);
+    fix_inode(fs, inode);
 
     cur_name = strtok(NULL, "/");
 
@@ -269,9 +559,63 @@ void resolve_path(FILE *image, fs_info *fs, minix_inode *inode,
   free(path_copy);
 }
 
+static void trace_close(void) {
+  if (trace_out != NULL && fclose(trace_out) != 0) {
+    perror("trace");
+  }
+  trace_out = NULL;
+}
+
+/*start recording every readinto and writeinto to path. init_fs does
+  this on its own when MINFS_TRACE is set*/
+void trace_open(const char *path) {
+  mintrace_header hdr;
+
+  if (trace_out != NULL) {
+    return;
+  }
+  trace_out = fopen(path, "w");
+  if (trace_out == NULL) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  setvbuf(trace_out, NULL, _IOFBF, TRACE_BUFSIZE);
+  hdr.magic = MINTRACE_MAGIC;
+  hdr.version = MINTRACE_VERSION;
+  hdr.record_size = sizeof(mintrace_record);
+  if (fwrite(&hdr, sizeof(hdr), 1, trace_out) != 1) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  atexit(trace_close);
+}
+
+/*set what the next reads are for. returns the old kind so library
+  code can put it back. per thread, like the reads it labels*/
+int trace_kind(int kind) {
+  int old = trace_cur;
+  trace_cur = kind;
+  return old;
+}
+
+/*stdio locks the stream, so threads sharing the trace are fine*/
+static void trace_record(off_t offset, size_t bytes, int kind) {
+  mintrace_record rec;
+  rec.offset = (uint64_t)offset;
+  rec.length = (uint32_t)bytes;
+  rec.kind = (uint8_t)kind;
+  if (fwrite(&rec, sizeof(rec), 1, trace_out) != 1) {
+    perror("trace");
+    exit(EXIT_FAILURE);
+  }
+}
+
 void readinto(void *thing, off_t offset, size_t bytes, FILE *image,
     size_t *tot){
   size_t bytes_read;
+  if (trace_out != NULL) {
+    trace_record(fs_start + offset, bytes, trace_cur);
+  }
   if (fseek(image, (fs_start + offset), SEEK_SET) != 0){
     perror("fseek");
     exit(EXIT_FAILURE);
@@ -289,7 +633,26 @@ void readinto(void *thing, off_t offset, size_t bytes, FILE *image,
   }
 }
 
+void writeinto(const void *thing, off_t offset, size_t bytes,
+    FILE *image){
+  if (trace_out != NULL) {
+    trace_record(fs_start + offset, bytes, trace_cur | TRACE_WRITE);
+  }
+  if (fseek(image, (fs_start + offset), SEEK_SET) != 0){
+    perror("fseek");
+    exit(EXIT_FAILURE);
+  }
+  if (fwrite(thing, sizeof(uint8_t), bytes, image) != bytes) {
+    perror("fwrite");
+    exit(EXIT_FAILURE);
+  }
+}
+
 off_t get_inode_offset(int node_num, fs_info *fs){
+  if (fs->blk_shift) {
+    return ((off_t)fs->firstIblock << fs->blk_shift) +
+        ((off_t)(node_num - 1) << INODE_SHIFT);
+  }
   return (fs->firstIblock * fs->sb.blocksize) +
       ((node_num - 1) * sizeof(minix_inode));
 }
@@ -297,6 +660,10 @@ off_t get_inode_offset(int node_num, fs_info *fs){
 void handle_superblock(FILE *image, fs_info *fs) {
   size_t bytes_read;
 
+  if (trace_out != NULL) {
+    trace_record(fs_start + SUPERBLOCK_OFFSET, sizeof(superblock),
+        TRACE_SUPER);
+  }
   if (fseek(image, (fs_start + SUPERBLOCK_OFFSET), SEEK_SET) != 0) {
     perror("fseek");
     exit(EXIT_FAILURE);
@@ -310,6 +677,19 @@ void handle_superblock(FILE *image, fs_info *fs) {
       exit(EXIT_FAILURE);
     }
   }
+  setup_superblock(fs);
+}
+
+/*check the superblock sitting in fs->sb and fill in the rest of fs.
+  split out so images that are not read through a FILE* can use it*/
+void setup_superblock(fs_info *fs) {
+  /*an image written on an opposite endian machine shows the magic
+    backwards. swap the superblock now and remember it for the rest*/
+  fs->swapped = 0;
+  if ((uint16_t)fs->sb.magic == MINIX_MAGIC_REVERSED) {
+    swap_superblock(&fs->sb);
+    fs->swapped = 1;
+  }
 
   if (fs->sb.magic != MINIX_MAGIC) {
     fprintf(stderr, "This doesn't look like a Minix filesystem.\n");
@@ -321,6 +701,61 @@ void handle_superblock(FILE *image, fs_info *fs) {
   fs->ptrs_per_blk = fs->sb.blocksize / sizeof(uint32_t);
   fs->links_per_zone = fs->zonesize / sizeof(minix_dirent);
   fs->ino_per_block = fs->sb.blocksize / sizeof(minix_inode);
+  pick_fast_path(fs);
+}
+
+/*does the start of a partition look like one? head holds its first
+  PART_PROBE_SIZE bytes. a minix superblock in either byte order counts,
+  and so does another partition table for -s to look in*/
+int part_start_valid(const uint8_t *head) {
+  uint16_t magic;
+  memcpy(&magic, head + SUPERBLOCK_OFFSET + offsetof(superblock, magic),
+      sizeof(magic));
+  if (magic == MINIX_MAGIC || magic == MINIX_MAGIC_REVERSED) {
+    return 1;
+  }
+  return head[BOOT_SIGNATURE_1_LOC] == BOOT_SIG_1 &&
+      head[BOOT_SIGNATURE_2_LOC] == BOOT_SIG_2;
+}
+
+static int part_probe(FILE *image, uint32_t first) {
+  uint8_t head[PART_PROBE_SIZE];
+  if (first == 0) {
+    return 0;
+  }
+  if (trace_out != NULL) {
+    trace_record((off_t)first * SECTOR_SIZE, sizeof(head), TRACE_PART);
+  }
+  if (fseeko(image, (off_t)first * SECTOR_SIZE, SEEK_SET) != 0 ||
+      fread(head, 1, sizeof(head), image) != sizeof(head)) {
+    clearerr(image);
+    return 0;
+  }
+  return part_start_valid(head);
+}
+
+/*check a partition table already in memory and pull one entry out*/
+void parse_part(const uint8_t *buf, int partition,
+    partition_entry *entry) {
+  if (buf[BOOT_SIGNATURE_1_LOC] != BOOT_SIG_1 ||
+      buf[BOOT_SIGNATURE_2_LOC] != BOOT_SIG_2) {
+    fprintf(stderr, "Invalid partition signature (0x%x, 0x%x).\n",
+            buf[BOOT_SIGNATURE_1_LOC], buf[BOOT_SIGNATURE_2_LOC]);
+    exit(EXIT_FAILURE);
+  }
+
+  if (memcpy(entry, &buf[PARTITION_TABLE_OFFSET + 
+            (sizeof(*entry) * partition)],
+             sizeof(*entry)) == NULL) {
+    perror("memcpy");
+    exit(EXIT_FAILURE);
+  }
+
+  if (entry->type != PARTITION_TYPE_MINIX) {
+    fprintf(stderr, 
+      "This doesn't look like a minix partition. (wrong type)\n");
+    exit(EXIT_FAILURE);
+  }
 }
 
 /* will change this to add implementation for main part and subpart
@@ -330,6 +765,9 @@ void handle_part(FILE *image, int partition) {
   size_t bytes_read;
   partition_entry entry;
 
+  if (trace_out != NULL) {
+    trace_record(fs_start, MBR_SIZE, TRACE_PART);
+  }
   if (fseek(image, fs_start, SEEK_SET) != 0) {
     perror("fseek");
     exit(EXIT_FAILURE);
@@ -343,25 +781,14 @@ void handle_part(FILE *image, int partition) {
     }
   }
 
+  parse_part(buf, partition, &entry);
 
-  if (buf[BOOT_SIGNATURE_1_LOC] != BOOT_SIG_1 ||
-      buf[BOOT_SIGNATURE_2_LOC] != BOOT_SIG_2) {
-    fprintf(stderr, "Invalid partition signature (0x%x, 0x%x).\n",
-            buf[BOOT_SIGNATURE_1_LOC], buf[BOOT_SIGNATURE_2_LOC]);
-    exit(EXIT_FAILURE);
-  }
-
-  if (memcpy(&entry, &buf[PARTITION_TABLE_OFFSET + 
-            (sizeof(entry) * partition)],
-             sizeof(entry)) == NULL) {
-    perror("memcpy");
-    exit(EXIT_FAILURE);
-  }
-
-  if (entry.type != PARTITION_TYPE_MINIX) {
-    fprintf(stderr, 
-      "This doesn't look like a minix partition. (wrong type)\n");
-    exit(EXIT_FAILURE);
+  /*the table has no magic of its own, so a table written big endian is
+    spotted by looking at what each reading of the entry points to*/
+  if (!part_probe(image, entry.lFirst) &&
+      part_probe(image, __builtin_bswap32(entry.lFirst))) {
+    entry.lFirst = __builtin_bswap32(entry.lFirst);
+    entry.size = __builtin_bswap32(entry.size);
   }
 
   if (fseek(image, entry.lFirst * SECTOR_SIZE, SEEK_SET) != 0) {
@@ -399,6 +826,7 @@ int read_inode(FILE *image, fs_info *fs, uint32_t ino,
   }
   off_t off = get_inode_offset((int)ino, fs);
   size_t nread = 0;
+  trace_kind(TRACE_INODE);
   readinto(out, off, sizeof(minix_inode), image, &nread);
   if (nread != sizeof(minix_inode)) {
     fprintf(stderr,
@@ -406,11 +834,16 @@ int read_inode(FILE *image, fs_info *fs, uint32_t ino,
             ino, nread);
     return -1;
   }
+  fix_inode(fs, out);
   /*successfully read inode*/
   return 0;
 }
 
 void init_fs(FILE *image, fs_info *fs, int primary, int subpart) {
+  const char *trace = getenv("MINFS_TRACE");
+  if (trace != NULL && *trace != '\0') {
+    trace_open(trace);
+  }
   if (primary == -1) {
     handle_superblock(image, fs);
   } else {
@@ -3,21 +3,36 @@
 
 #include <stdio.h>
 #include "min.h"
+#include "mintrace.h"
 
 extern off_t fs_start;
 extern off_t fs_end;
 
+/* bytes from a partition's start that part_start_valid looks at */
+#define PART_PROBE_SIZE (SUPERBLOCK_OFFSET + sizeof(superblock))
+
 typedef int (*zone_visit_fn)(const zone_span *span, void *user);
 
 void handle_part(FILE *image, int partition);
 void handle_superblock(FILE *image, fs_info *fs);
+void setup_superblock(fs_info *fs);
+void parse_part(const uint8_t *buf, int partition, partition_entry *entry);
+int part_start_valid(const uint8_t *head);
 void init_fs(FILE *image, fs_info *fs, int primary, int subpart);
 void print_superblock(fs_info *fs);
 off_t get_inode_offset(int node_num, fs_info *fs);
 void readinto(void *thing, off_t offset, size_t bytes, FILE *image, 
   size_t *tot);
+void writeinto(const void *thing, off_t offset, size_t bytes,
+  FILE *image);
+void trace_open(const char *path);
+int trace_kind(int kind);
 void resolve_path(FILE *image, fs_info *fs, minix_inode *inode, char *path);
 int read_inode(FILE *image, fs_info *fs, uint32_t ino, minix_inode *out);
+void swap_table32(uint32_t *tbl, size_t n);
+void fix_inode(const fs_info *fs, minix_inode *in);
+void fix_dirent(const fs_info *fs, minix_dirent *d);
+void fix_table(const fs_info *fs, uint32_t *tbl, size_t n);
 int iterate_file_zones(FILE *image, fs_info *fs, const minix_inode *in,
     zone_visit_fn cb, void *user
 );
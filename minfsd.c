@@ -0,0 +1,1017 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "minfs_common.h"
+#include "min.h"
+#include "minfsd.h"
+
+#define BASE 10
+#define MAXPART 3
+#define MINPART 0
+
+#define MAX_IMAGES 256
+#define MAX_WORKERS 256
+#define MAX_EVENTS 128
+#define LISTEN_BACKLOG 512
+#define READ_CHUNK 16384
+#define READ_BUDGET (READ_CHUNK * 4)
+#define HIGH_WATER (1024 * 1024)
+#define MAX_CONN_JOBS 256
+#define DIRENT_NAME_SIZE 60
+
+#define USAGE "usage: minfsd [ -v ] [ -j workers ] -S socket " \
+  "imagefile[:p[:s]] ...\n"
+
+/* one name in a cached directory, names live in the image's arena */
+typedef struct {
+  uint32_t ino;
+  uint32_t name;
+  uint8_t  len;
+} dir_slot;
+
+/* every entry of a directory, sorted by name for lookups */
+typedef struct {
+  dir_slot *slots;
+  uint32_t  count;
+} dir_cache;
+
+/* an image opened once at startup and kept warm for the whole run */
+typedef struct {
+  const char *file;
+  FILE *image;
+  int fd;
+  off_t base;
+  fs_info fs;
+  minix_inode *inodes;
+  dir_cache *dirs;
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+} served_image;
+
+/* a client. the main thread owns the socket and the input side, workers
+   only append replies to out under mu. jobs counts requests handed to
+   workers and not answered yet */
+typedef struct conn {
+  int fd;
+  int refs;
+  int closed;
+  int rd_shut;
+  int queued;
+  int jobs;
+  uint32_t armed;
+  uint8_t *in;
+  size_t in_len;
+  size_t in_cap;
+  pthread_mutex_t mu;
+  uint8_t *out;
+  size_t out_off;
+  size_t out_len;
+  size_t out_cap;
+  struct conn *next_ready;
+} conn;
+
+typedef struct job {
+  struct job *next;
+  conn *c;
+  minfsd_request req;
+  char path[];
+} job;
+
+/* used while building a directory cache at startup */
+typedef struct {
+  served_image *img;
+  dir_cache *dir;
+  uint32_t cap;
+} load_context;
+
+static int verbose = 0;
+static int nworkers = 0;
+static const char *sockpath = NULL;
+static served_image images[MAX_IMAGES];
+static int nimages = 0;
+
+static volatile sig_atomic_t stopping = 0;
+static int epfd = -1;
+static int wakefd = -1;
+
+static pthread_mutex_t jobs_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cv = PTHREAD_COND_INITIALIZER;
+static job *jobs_head = NULL;
+static job *jobs_tail = NULL;
+static int jobs_done = 0;
+
+static pthread_mutex_t ready_mu = PTHREAD_MUTEX_INITIALIZER;
+static conn *ready_head = NULL;
+
+static uint64_t served = 0;
+
+/* epoll tags for the two fds that are not clients */
+static int listen_tag;
+static int wake_tag;
+
+/* parse command line arguments */
+void parse_options(int argc, char *argv[]) {
+  int opt;
+  char *end;
+
+  while ((opt = getopt(argc, argv, "vj:S:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'j':
+        nworkers = strtol(optarg, &end, BASE);
+        if (end == optarg || *end != '\0' || nworkers < 1 ||
+            nworkers > MAX_WORKERS) {
+          fprintf(stderr, "-j usage: j <1..%d>\n", MAX_WORKERS);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'S':
+        sockpath = optarg;
+        break;
+      default:
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (sockpath == NULL || optind >= argc) {
+    fprintf(stderr, USAGE);
+    exit(EXIT_FAILURE);
+  }
+  if (argc - optind > MAX_IMAGES) {
+    fprintf(stderr, "minfsd: at most %d images.\n", MAX_IMAGES);
+    exit(EXIT_FAILURE);
+  }
+  if (nworkers == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = cpus < 1 ? 1 : (cpus > MAX_WORKERS ? MAX_WORKERS : cpus);
+  }
+}
+
+static void *xmalloc(size_t size) {
+  void *p = malloc(size);
+  if (p == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static void *xrealloc(void *p, size_t size) {
+  void *q = realloc(p, size);
+  if (q == NULL) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  return q;
+}
+
+/* split "file:p:s" into its parts, partitions are optional */
+static void parse_image_spec(char *spec, int *primary, int *subpart) {
+  char *colon = strchr(spec, ':');
+  char *end;
+
+  *primary = -1;
+  *subpart = -1;
+  if (colon == NULL) {
+    return;
+  }
+  *colon++ = '\0';
+  *primary = strtol(colon, &end, BASE);
+  if (end == colon || *primary > MAXPART || *primary < MINPART) {
+    fprintf(stderr,
+      "Partition %d out of range.  Must be 0..3.\n", *primary);
+    exit(EXIT_FAILURE);
+  }
+  if (*end == ':') {
+    colon = end + 1;
+    *subpart = strtol(colon, &end, BASE);
+    if (end == colon || *subpart > MAXPART || *subpart < MINPART) {
+      fprintf(stderr,
+        "Partition %d out of range.  Must be 0..3.\n", *subpart);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static const served_image *sort_image;
+
+static int cmp_slot(const void *a, const void *b) {
+  const dir_slot *x = (const dir_slot *)a;
+  const dir_slot *y = (const dir_slot *)b;
+  uint8_t n = x->len < y->len ? x->len : y->len;
+  int r = memcmp(sort_image->names + x->name, sort_image->names + y->name,
+      n);
+  if (r != 0) {
+    return r;
+  }
+  return (int)x->len - (int)y->len;
+}
+
+/* read a whole directory zone at once and keep its live entries */
+int load_zone_callback(const zone_span *span, void *user) {
+  load_context *ctx = (load_context *)user;
+  served_image *img = ctx->img;
+  minix_dirent *ents;
+  uint32_t n;
+  uint32_t i;
+
+  if (span->is_hole) {
+    return 0;
+  }
+  n = span->length / sizeof(minix_dirent);
+  ents = (minix_dirent *)xmalloc((size_t)n * sizeof(minix_dirent));
+  trace_kind(TRACE_DIRENT);
+  readinto(ents, span->image_off, (size_t)n * sizeof(minix_dirent),
+      img->image, NULL);
+  for (i = 0; i < n; i++) {
+    dir_slot *slot;
+    size_t len;
+    fix_dirent(&img->fs, &ents[i]);
+    if (ents[i].inode == 0 || ents[i].inode > img->fs.sb.ninodes) {
+      continue;
+    }
+    len = strnlen(ents[i].name, DIRENT_NAME_SIZE);
+    if (ctx->dir->count == ctx->cap) {
+      ctx->cap = ctx->cap ? ctx->cap * 2 : 16;
+      ctx->dir->slots = (dir_slot *)xrealloc(ctx->dir->slots,
+          ctx->cap * sizeof(dir_slot));
+    }
+    if (img->names_len + len > img->names_cap) {
+      img->names_cap = (img->names_cap + len) * 2;
+      img->names = (char *)xrealloc(img->names, img->names_cap);
+    }
+    slot = &ctx->dir->slots[ctx->dir->count++];
+    slot->ino = ents[i].inode;
+    slot->name = (uint32_t)img->names_len;
+    slot->len = (uint8_t)len;
+    memcpy(img->names + img->names_len, ents[i].name, len);
+    img->names_len += len;
+  }
+  free(ents);
+  return 0;
+}
+
+/* open an image through init_fs() and pull in its inode table and every
+   directory, so requests never wait on metadata reads */
+static void load_image(served_image *img, char *spec) {
+  int primary;
+  int subpart;
+  uint32_t ino;
+  uint32_t ndirs = 0;
+  load_context ctx;
+
+  parse_image_spec(spec, &primary, &subpart);
+  img->file = spec;
+  img->image = fopen(spec, "r");
+  if (img->image == NULL) {
+    perror(spec);
+    exit(EXIT_FAILURE);
+  }
+  img->fd = fileno(img->image);
+
+  /* fs_start is shared, start each image from the top of its file */
+  fs_start = 0;
+  init_fs(img->image, &img->fs, primary, subpart);
+  img->base = fs_start;
+
+  img->inodes = (minix_inode *)calloc((size_t)img->fs.sb.ninodes + 1,
+      sizeof(minix_inode));
+  img->dirs = (dir_cache *)calloc((size_t)img->fs.sb.ninodes + 1,
+      sizeof(dir_cache));
+  if (img->inodes == NULL || img->dirs == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  trace_kind(TRACE_INODE);
+  readinto(&img->inodes[1], get_inode_offset(1, &img->fs),
+      (size_t)img->fs.sb.ninodes * sizeof(minix_inode), img->image, NULL);
+
+  sort_image = img;
+  for (ino = 1; ino <= img->fs.sb.ninodes; ino++) {
+    minix_inode *in = &img->inodes[ino];
+    fix_inode(&img->fs, in);
+    if (in->links == 0 || (in->mode & FILEMASK) != DIRECTORY) {
+      continue;
+    }
+    ctx.img = img;
+    ctx.dir = &img->dirs[ino];
+    ctx.cap = 0;
+    iterate_file_zones(img->image, &img->fs, in, load_zone_callback,
+        &ctx);
+    qsort(ctx.dir->slots, ctx.dir->count, sizeof(dir_slot), cmp_slot);
+    ndirs++;
+  }
+
+  if (verbose) {
+    printf("verbose: %s: %u inodes, %u directories, %zu name bytes\n",
+        img->file, img->fs.sb.ninodes, ndirs, img->names_len);
+  }
+}
+
+static const dir_slot *find_slot(const served_image *img,
+    const dir_cache *dir, const char *name, size_t len) {
+  uint32_t lo = 0;
+  uint32_t hi = dir->count;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const dir_slot *s = &dir->slots[mid];
+    size_t n = s->len < len ? s->len : len;
+    int r = memcmp(img->names + s->name, name, n);
+    if (r == 0) {
+      r = (int)s->len - (int)len;
+    }
+    if (r == 0) {
+      return s;
+    }
+    if (r < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return NULL;
+}
+
+/* walk a path through the cached directories. 0 or an errno value */
+static int lookup(const served_image *img, const char *path, size_t len,
+    uint32_t *out) {
+  uint32_t ino = 1;
+  size_t i = 0;
+
+  while (i < len) {
+    const dir_slot *s;
+    size_t start;
+    while (i < len && path[i] == '/') {
+      i++;
+    }
+    if (i == len) {
+      break;
+    }
+    start = i;
+    while (i < len && path[i] != '/') {
+      i++;
+    }
+    if (i - start > DIRENT_NAME_SIZE) {
+      return ENAMETOOLONG;
+    }
+    if ((img->inodes[ino].mode & FILEMASK) != DIRECTORY) {
+      return ENOTDIR;
+    }
+    s = find_slot(img, &img->dirs[ino], path + start, i - start);
+    if (s == NULL) {
+      return ENOENT;
+    }
+    ino = s->ino;
+  }
+  *out = ino;
+  return 0;
+}
+
+static void fill_stat(minfsd_stat *st, uint32_t ino,
+    const minix_inode *in) {
+  st->ino = ino;
+  st->mode = in->mode;
+  st->links = in->links;
+  st->uid = in->uid;
+  st->gid = in->gid;
+  st->size = in->size;
+  st->atime = in->atime;
+  st->mtime = in->mtime;
+  st->ctime = in->ctime;
+}
+
+static int pread_full(const served_image *img, void *buf, size_t bytes,
+    off_t off) {
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t n = pread(img->fd, (uint8_t *)buf + done, bytes - done,
+        img->base + off + (off_t)done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return EIO;
+    }
+    done += (size_t)n;
+  }
+  return 0;
+}
+
+/* one pointer out of a table, straight from the image */
+static int table_entry(const served_image *img, uint32_t table,
+    uint32_t idx, uint32_t *out) {
+  int rc = pread_full(img, out, sizeof(uint32_t),
+      (off_t)table * img->fs.zonesize + (off_t)idx * sizeof(uint32_t));
+  if (rc == 0) {
+    fix_table(&img->fs, out, 1);
+  }
+  return rc;
+}
+
+/* which zone holds zone index idx of a file, 0 for a hole */
+static int zone_of(const served_image *img, const minix_inode *in,
+    uint32_t idx, uint32_t *zone) {
+  uint32_t ptrs = img->fs.ptrs_per_blk;
+  uint32_t leaf;
+  int rc;
+
+  if (idx < DIRECT_ZONES) {
+    *zone = in->zone[idx];
+    return 0;
+  }
+  idx -= DIRECT_ZONES;
+  if (idx < ptrs) {
+    *zone = 0;
+    return in->indirect ? table_entry(img, in->indirect, idx, zone) : 0;
+  }
+  idx -= ptrs;
+  *zone = 0;
+  if (in->two_indirect == 0 || idx / ptrs >= ptrs) {
+    return 0;
+  }
+  rc = table_entry(img, in->two_indirect, idx / ptrs, &leaf);
+  if (rc != 0 || leaf == 0) {
+    return rc;
+  }
+  return table_entry(img, leaf, idx % ptrs, zone);
+}
+
+static int read_range(const served_image *img, const minix_inode *in,
+    uint64_t off, uint32_t len, uint8_t *out, uint32_t *got) {
+  uint32_t zs = img->fs.zonesize;
+  uint32_t done = 0;
+
+  *got = 0;
+  if (off >= in->size) {
+    return 0;
+  }
+  if (len > in->size - off) {
+    len = (uint32_t)(in->size - off);
+  }
+  while (done < len) {
+    uint64_t at = off + done;
+    uint32_t within = (uint32_t)(at % zs);
+    uint32_t chunk = zs - within;
+    uint32_t zone;
+    int rc;
+    if (chunk > len - done) {
+      chunk = len - done;
+    }
+    rc = zone_of(img, in, (uint32_t)(at / zs), &zone);
+    if (rc != 0) {
+      return rc;
+    }
+    if (zone == 0) {
+      memset(out + done, 0, chunk);
+    } else {
+      rc = pread_full(img, out + done, chunk,
+          (off_t)zone * zs + within);
+      if (rc != 0) {
+        return rc;
+      }
+    }
+    done += chunk;
+  }
+  *got = done;
+  return 0;
+}
+
+static void conn_put(conn *c) {
+  if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    pthread_mutex_destroy(&c->mu);
+    free(c->in);
+    free(c->out);
+    free(c);
+  }
+}
+
+/* queue a reply on the connection and tell the main thread about it */
+static void send_reply(conn *c, uint32_t id, int status,
+    const void *payload, uint32_t len) {
+  minfsd_reply rep;
+  size_t need;
+  uint64_t one = 1;
+  int wake = 0;
+
+  rep.id = id;
+  rep.status = status;
+  rep.length = status ? 0 : len;
+
+  pthread_mutex_lock(&c->mu);
+  need = c->out_len + sizeof(rep) + rep.length;
+  if (need > c->out_cap) {
+    c->out_cap = need * 2;
+    c->out = (uint8_t *)xrealloc(c->out, c->out_cap);
+  }
+  memcpy(c->out + c->out_len, &rep, sizeof(rep));
+  if (rep.length) {
+    memcpy(c->out + c->out_len + sizeof(rep), payload, rep.length);
+  }
+  c->out_len = need;
+  __atomic_sub_fetch(&c->jobs, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_unlock(&c->mu);
+
+  pthread_mutex_lock(&ready_mu);
+  if (!c->queued) {
+    c->queued = 1;
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_ACQ_REL);
+    c->next_ready = ready_head;
+    ready_head = c;
+    wake = 1;
+  }
+  pthread_mutex_unlock(&ready_mu);
+  if (wake && write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("write");
+  }
+}
+
+static void serve_readdir(job *j, const served_image *img, uint32_t ino) {
+  const dir_cache *dir = &img->dirs[ino];
+  uint8_t *buf;
+  size_t len = 0;
+  uint32_t i;
+
+  buf = (uint8_t *)xmalloc((size_t)dir->count *
+      (sizeof(minfsd_stat) + 1 + DIRENT_NAME_SIZE) + 1);
+  for (i = 0; i < dir->count; i++) {
+    const dir_slot *s = &dir->slots[i];
+    minfsd_stat st;
+    fill_stat(&st, s->ino, &img->inodes[s->ino]);
+    memcpy(buf + len, &st, sizeof(st));
+    len += sizeof(st);
+    buf[len++] = s->len;
+    memcpy(buf + len, img->names + s->name, s->len);
+    len += s->len;
+  }
+  send_reply(j->c, j->req.id, 0, buf, (uint32_t)len);
+  free(buf);
+}
+
+static void serve(job *j) {
+  const served_image *img;
+  const minix_inode *in;
+  uint32_t ino;
+  int rc;
+
+  if (j->req.image >= nimages) {
+    send_reply(j->c, j->req.id, ENODEV, NULL, 0);
+    return;
+  }
+  img = &images[j->req.image];
+  rc = lookup(img, j->path, j->req.path_len, &ino);
+  if (rc != 0) {
+    send_reply(j->c, j->req.id, rc, NULL, 0);
+    return;
+  }
+  in = &img->inodes[ino];
+
+  switch (j->req.op) {
+    case MINFSD_STAT: {
+      minfsd_stat st;
+      fill_stat(&st, ino, in);
+      send_reply(j->c, j->req.id, 0, &st, sizeof(st));
+      break;
+    }
+    case MINFSD_READDIR:
+      if ((in->mode & FILEMASK) != DIRECTORY) {
+        send_reply(j->c, j->req.id, ENOTDIR, NULL, 0);
+      } else {
+        serve_readdir(j, img, ino);
+      }
+      break;
+    case MINFSD_READ: {
+      uint32_t want = j->req.length;
+      uint32_t got;
+      uint8_t *buf;
+      if ((in->mode & FILEMASK) == DIRECTORY) {
+        send_reply(j->c, j->req.id, EISDIR, NULL, 0);
+        break;
+      }
+      if (want > MINFSD_MAX_READ) {
+        want = MINFSD_MAX_READ;
+      }
+      buf = (uint8_t *)xmalloc(want ? want : 1);
+      rc = read_range(img, in, j->req.offset, want, buf, &got);
+      send_reply(j->c, j->req.id, rc, buf, got);
+      free(buf);
+      break;
+    }
+    default:
+      send_reply(j->c, j->req.id, EINVAL, NULL, 0);
+      break;
+  }
+}
+
+static void *worker(void *arg) {
+  (void)arg;
+  for (;;) {
+    job *j;
+    pthread_mutex_lock(&jobs_mu);
+    while (jobs_head == NULL && !jobs_done) {
+      pthread_cond_wait(&jobs_cv, &jobs_mu);
+    }
+    j = jobs_head;
+    if (j == NULL) {
+      pthread_mutex_unlock(&jobs_mu);
+      break;
+    }
+    jobs_head = j->next;
+    if (jobs_head == NULL) {
+      jobs_tail = NULL;
+    }
+    pthread_mutex_unlock(&jobs_mu);
+
+    serve(j);
+    __atomic_add_fetch(&served, 1, __ATOMIC_RELAXED);
+    conn_put(j->c);
+    free(j);
+  }
+  return NULL;
+}
+
+static void push_job(job *j) {
+  j->next = NULL;
+  pthread_mutex_lock(&jobs_mu);
+  if (jobs_tail) {
+    jobs_tail->next = j;
+  } else {
+    jobs_head = j;
+  }
+  jobs_tail = j;
+  pthread_cond_signal(&jobs_cv);
+  pthread_mutex_unlock(&jobs_mu);
+}
+
+static void close_conn(conn *c) {
+  if (c->closed) {
+    return;
+  }
+  c->closed = 1;
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  conn_put(c);
+}
+
+/* cut complete requests off the front of the input buffer, leaving
+   them there while the connection has MAX_CONN_JOBS in flight */
+static int parse_requests(conn *c) {
+  size_t used = 0;
+
+  while (c->in_len - used >= sizeof(minfsd_request) &&
+      __atomic_load_n(&c->jobs, __ATOMIC_ACQUIRE) < MAX_CONN_JOBS) {
+    minfsd_request req;
+    job *j;
+    memcpy(&req, c->in + used, sizeof(req));
+    if (req.magic != MINFSD_MAGIC || req.path_len > MINFSD_MAX_PATH) {
+      return -1;
+    }
+    if (c->in_len - used < sizeof(req) + req.path_len) {
+      break;
+    }
+    j = (job *)xmalloc(sizeof(job) + req.path_len + 1);
+    j->req = req;
+    j->c = c;
+    memcpy(j->path, c->in + used + sizeof(req), req.path_len);
+    j->path[req.path_len] = '\0';
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&c->jobs, 1, __ATOMIC_ACQ_REL);
+    push_job(j);
+    used += sizeof(req) + req.path_len;
+  }
+  if (used > 0) {
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+  }
+  return 0;
+}
+
+/* hand held back requests to the workers and pick what epoll should
+   wait for. reading stops while either buffer is over HIGH_WATER or
+   too many requests are in flight, so a client that sends faster than
+   it reads cannot grow us without bound. after the client shuts its
+   side down it gets every reply before we close */
+static void update_conn(conn *c) {
+  struct epoll_event ev;
+  uint32_t want = 0;
+  size_t queued;
+  int jobs;
+
+  if (c->closed) {
+    return;
+  }
+  pthread_mutex_lock(&c->mu);
+  queued = c->out_len - c->out_off;
+  pthread_mutex_unlock(&c->mu);
+  if (queued < HIGH_WATER && parse_requests(c) != 0) {
+    close_conn(c);
+    return;
+  }
+  pthread_mutex_lock(&c->mu);
+  queued = c->out_len - c->out_off;
+  jobs = __atomic_load_n(&c->jobs, __ATOMIC_ACQUIRE);
+  pthread_mutex_unlock(&c->mu);
+
+  if (c->rd_shut && jobs == 0 && queued == 0) {
+    close_conn(c);
+    return;
+  }
+  if (!c->rd_shut && c->in_len < HIGH_WATER && queued < HIGH_WATER &&
+      jobs < MAX_CONN_JOBS) {
+    want |= EPOLLIN;
+  }
+  if (queued > 0) {
+    want |= EPOLLOUT;
+  }
+  if (want == c->armed) {
+    return;
+  }
+  ev.events = want;
+  ev.data.ptr = c;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0) {
+    c->armed = want;
+  }
+}
+
+/* push out what we can without blocking, EPOLLOUT picks up the rest */
+static void flush_conn(conn *c) {
+  if (c->closed) {
+    return;
+  }
+  pthread_mutex_lock(&c->mu);
+  while (c->out_off < c->out_len) {
+    ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+        MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        pthread_mutex_unlock(&c->mu);
+        close_conn(c);
+        return;
+      }
+      break;
+    }
+    c->out_off += (size_t)n;
+  }
+  /* keep what is left at the front so out stays near its high water */
+  if (c->out_off > 0) {
+    memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+    c->out_len -= c->out_off;
+    c->out_off = 0;
+  }
+  pthread_mutex_unlock(&c->mu);
+  update_conn(c);
+}
+
+/* take at most READ_BUDGET per call so one busy client cannot hold up
+   the rest, epoll reports it again while more is waiting. end of file
+   only stops reading, update_conn closes once the replies are out */
+static void read_conn(conn *c) {
+  size_t took = 0;
+
+  if (c->closed || c->rd_shut) {
+    return;
+  }
+  while (took < READ_BUDGET && c->in_len < HIGH_WATER) {
+    size_t room;
+    ssize_t n;
+    if (c->in_cap - c->in_len < READ_CHUNK) {
+      c->in_cap = c->in_len + READ_CHUNK * 2;
+      c->in = (uint8_t *)xrealloc(c->in, c->in_cap);
+    }
+    room = c->in_cap - c->in_len;
+    if (room > READ_BUDGET - took) {
+      room = READ_BUDGET - took;
+    }
+    n = recv(c->fd, c->in + c->in_len, room, 0);
+    if (n > 0) {
+      c->in_len += (size_t)n;
+      took += (size_t)n;
+      continue;
+    }
+    if (n == 0) {
+      c->rd_shut = 1;
+      break;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    }
+    close_conn(c);
+    return;
+  }
+  update_conn(c);
+}
+
+static void accept_conns(int lfd) {
+  for (;;) {
+    struct epoll_event ev;
+    conn *c;
+    int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("accept4");
+      }
+      return;
+    }
+    c = (conn *)calloc(1, sizeof(conn));
+    if (c == NULL) {
+      perror("calloc");
+      close(fd);
+      return;
+    }
+    c->fd = fd;
+    c->refs = 1;
+    c->armed = EPOLLIN;
+    pthread_mutex_init(&c->mu, NULL);
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      perror("epoll_ctl");
+      close(fd);
+      conn_put(c);
+    }
+  }
+}
+
+/* workers have replies waiting. queued is cleared per connection only
+   after its next pointer is read, since a worker may queue it again */
+static void flush_ready(void) {
+  uint64_t count;
+  conn *c;
+
+  if (read(wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    perror("read");
+  }
+  pthread_mutex_lock(&ready_mu);
+  c = ready_head;
+  ready_head = NULL;
+  pthread_mutex_unlock(&ready_mu);
+
+  while (c != NULL) {
+    conn *next;
+    pthread_mutex_lock(&ready_mu);
+    next = c->next_ready;
+    c->queued = 0;
+    pthread_mutex_unlock(&ready_mu);
+    flush_conn(c);
+    conn_put(c);
+    c = next;
+  }
+}
+
+static void on_stop(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+static int open_socket(void) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long.\n", sockpath);
+    exit(EXIT_FAILURE);
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sockpath);
+  unlink(sockpath);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("bind");
+    exit(EXIT_FAILURE);
+  }
+  if (listen(fd, LISTEN_BACKLOG) != 0) {
+    perror("listen");
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  pthread_t threads[MAX_WORKERS];
+  struct epoll_event events[MAX_EVENTS];
+  struct epoll_event ev;
+  struct sigaction sa;
+  int lfd;
+  int i;
+
+  parse_options(argc, argv);
+  for (i = optind; i < argc; i++) {
+    load_image(&images[nimages++], argv[i]);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  lfd = open_socket();
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epfd < 0 || wakefd < 0) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &listen_tag;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+  ev.data.ptr = &wake_tag;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+
+  for (i = 0; i < nworkers; i++) {
+    if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (verbose) {
+    printf("verbose: serving %d images on %s with %d workers\n",
+        nimages, sockpath, nworkers);
+    fflush(stdout);
+  }
+
+  while (!stopping) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      break;
+    }
+    /* any handler below can close a connection, and the last put frees
+       it. hold every connection in this batch until the batch is done */
+    for (i = 0; i < n; i++) {
+      void *tag = events[i].data.ptr;
+      if (tag != &listen_tag && tag != &wake_tag) {
+        __atomic_add_fetch(&((conn *)tag)->refs, 1, __ATOMIC_ACQ_REL);
+      }
+    }
+    for (i = 0; i < n; i++) {
+      void *tag = events[i].data.ptr;
+      if (tag == &listen_tag) {
+        accept_conns(lfd);
+      } else if (tag == &wake_tag) {
+        flush_ready();
+      } else {
+        conn *c = (conn *)tag;
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          close_conn(c);
+          continue;
+        }
+        if (events[i].events & EPOLLOUT) {
+          flush_conn(c);
+        }
+        if (events[i].events & EPOLLIN) {
+          read_conn(c);
+        }
+      }
+    }
+    for (i = 0; i < n; i++) {
+      void *tag = events[i].data.ptr;
+      if (tag != &listen_tag && tag != &wake_tag) {
+        conn_put((conn *)tag);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&jobs_mu);
+  jobs_done = 1;
+  pthread_cond_broadcast(&jobs_cv);
+  pthread_mutex_unlock(&jobs_mu);
+  for (i = 0; i < nworkers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (verbose) {
+    printf("verbose: served %llu requests\n", (unsigned long long)served);
+  }
+  close(lfd);
+  unlink(sockpath);
+  return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef MINFSD_H
+#define MINFSD_H
+
+#include <stdint.h>
+
+/* wire protocol between minfsd and its clients. everything is in host
+   byte order, the socket never leaves the machine */
+
+#define MINFSD_MAGIC      0x4D46
+#define MINFSD_MAX_PATH   4096
+#define MINFSD_MAX_READ   65536
+
+enum minfsd_op {
+  MINFSD_STAT    = 1,
+  MINFSD_READDIR = 2,
+  MINFSD_READ    = 3
+};
+
+/* followed by path_len bytes of path, no terminator. offset and length
+   only mean something for MINFSD_READ */
+typedef struct __attribute__((packed)) minfsd_request {
+  uint16_t magic;
+  uint8_t  op;
+  uint8_t  image;
+  uint32_t id;
+  uint64_t offset;
+  uint32_t length;
+  uint16_t path_len;
+} minfsd_request;
+
+/* followed by length bytes of payload. status is 0 or an errno value.
+   replies on one connection can come back in any order, id says which
+   request they answer */
+typedef struct __attribute__((packed)) minfsd_reply {
+  uint32_t id;
+  int32_t  status;
+  uint32_t length;
+} minfsd_reply;
+
+/* MINFSD_STAT payload. MINFSD_READDIR sends one of these per entry,
+   each followed by a name_len byte and the name */
+typedef struct __attribute__((packed)) minfsd_stat {
+  uint32_t ino;
+  uint16_t mode;
+  uint16_t links;
+  uint16_t uid;
+  uint16_t gid;
+  uint32_t size;
+  int32_t  atime;
+  int32_t  mtime;
+  int32_t  ctime;
+} minfsd_stat;
+
+#endif
@@ -0,0 +1,318 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "minfsd.h"
+
+#define BASE 10
+
+#define MAX_CONNS 1024
+#define MAX_DEPTH 1024
+#define DEFAULT_CONNS 4
+#define DEFAULT_DEPTH 8
+#define DEFAULT_SECONDS 5
+#define DEFAULT_READ 4096
+#define NSEC 1000000000ULL
+
+#define USAGE "usage: minfsload [ -c conns ] [ -d depth ] [ -t seconds ] " \
+  "[ -o stat|readdir|read ] [ -i image ] [ -l length ] socket path ...\n"
+
+/* one connection keeping depth requests in flight */
+typedef struct {
+  int fd;
+  uint64_t *lat;
+  size_t nlat;
+  size_t cap;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t sent_at[MAX_DEPTH];
+  size_t next_path;
+  int index;
+} load_conn;
+
+static int nconns = DEFAULT_CONNS;
+static int depth = DEFAULT_DEPTH;
+static int seconds = DEFAULT_SECONDS;
+static int op = MINFSD_STAT;
+static int image = 0;
+static uint32_t read_len = DEFAULT_READ;
+static const char *sockpath = NULL;
+static char **paths = NULL;
+static int npaths = 0;
+static uint64_t deadline = 0;
+
+static long number(const char *arg, const char *flag, long lo, long hi) {
+  char *end;
+  long v = strtol(arg, &end, BASE);
+  if (end == arg || *end != '\0' || v < lo || v > hi) {
+    fprintf(stderr, "-%s usage: %s <%ld..%ld>\n", flag, flag, lo, hi);
+    exit(EXIT_FAILURE);
+  }
+  return v;
+}
+
+/* parse command line arguments */
+void parse_options(int argc, char *argv[]) {
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:d:t:o:i:l:")) != -1) {
+    switch (opt) {
+      case 'c':
+        nconns = (int)number(optarg, "c", 1, MAX_CONNS);
+        break;
+      case 'd':
+        depth = (int)number(optarg, "d", 1, MAX_DEPTH);
+        break;
+      case 't':
+        seconds = (int)number(optarg, "t", 1, 3600);
+        break;
+      case 'i':
+        image = (int)number(optarg, "i", 0, 255);
+        break;
+      case 'l':
+        read_len = (uint32_t)number(optarg, "l", 0, MINFSD_MAX_READ);
+        break;
+      case 'o':
+        if (strcmp(optarg, "stat") == 0) {
+          op = MINFSD_STAT;
+        } else if (strcmp(optarg, "readdir") == 0) {
+          op = MINFSD_READDIR;
+        } else if (strcmp(optarg, "read") == 0) {
+          op = MINFSD_READ;
+        } else {
+          fprintf(stderr, "-o usage: o stat|readdir|read\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (argc - optind < 2) {
+    fprintf(stderr, USAGE);
+    exit(EXIT_FAILURE);
+  }
+  sockpath = argv[optind++];
+  paths = &argv[optind];
+  npaths = argc - optind;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NSEC + (uint64_t)ts.tv_nsec;
+}
+
+static int connect_socket(void) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror(sockpath);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+static void write_all(int fd, const void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = send(fd, (const uint8_t *)buf + done, len - done,
+        MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      perror("send");
+      exit(EXIT_FAILURE);
+    }
+    done += (size_t)n;
+  }
+}
+
+static void read_all(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = recv(fd, (uint8_t *)buf + done, len - done, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "minfsload: server went away.\n");
+      exit(EXIT_FAILURE);
+    }
+    done += (size_t)n;
+  }
+}
+
+/* request ids are slot numbers, so a reply finds its send time directly */
+static void send_request(load_conn *lc, uint32_t slot) {
+  uint8_t buf[sizeof(minfsd_request) + MINFSD_MAX_PATH];
+  const char *path = paths[lc->next_path];
+  size_t len = strlen(path);
+  minfsd_request req;
+
+  lc->next_path = (lc->next_path + 1) % npaths;
+  if (len > MINFSD_MAX_PATH) {
+    len = MINFSD_MAX_PATH;
+  }
+  memset(&req, 0, sizeof(req));
+  req.magic = MINFSD_MAGIC;
+  req.op = (uint8_t)op;
+  req.image = (uint8_t)image;
+  req.id = slot;
+  req.length = read_len;
+  req.path_len = (uint16_t)len;
+  memcpy(buf, &req, sizeof(req));
+  memcpy(buf + sizeof(req), path, len);
+  lc->sent_at[slot] = now_ns();
+  write_all(lc->fd, buf, sizeof(req) + len);
+}
+
+static void *run_conn(void *arg) {
+  load_conn *lc = (load_conn *)arg;
+  uint8_t *payload = (uint8_t *)malloc(MINFSD_MAX_READ + 1);
+  int inflight = 0;
+  int d;
+
+  if (payload == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  lc->fd = connect_socket();
+  lc->next_path = (size_t)lc->index % npaths;
+  for (d = 0; d < depth; d++) {
+    send_request(lc, (uint32_t)d);
+    inflight++;
+  }
+
+  while (inflight > 0) {
+    minfsd_reply rep;
+    uint64_t t;
+    read_all(lc->fd, &rep, sizeof(rep));
+    t = now_ns();
+    while (rep.length > 0) {
+      uint32_t chunk = rep.length > MINFSD_MAX_READ ? MINFSD_MAX_READ :
+          rep.length;
+      read_all(lc->fd, payload, chunk);
+      lc->bytes += chunk;
+      rep.length -= chunk;
+    }
+    inflight--;
+    if (rep.id >= (uint32_t)depth) {
+      fprintf(stderr, "minfsload: reply for unknown request %u\n", rep.id);
+      exit(EXIT_FAILURE);
+    }
+    if (rep.status != 0) {
+      lc->errors++;
+    }
+    if (lc->nlat == lc->cap) {
+      lc->cap = lc->cap ? lc->cap * 2 : 65536;
+      lc->lat = (uint64_t *)realloc(lc->lat, lc->cap * sizeof(uint64_t));
+      if (lc->lat == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    lc->lat[lc->nlat++] = t - lc->sent_at[rep.id];
+    if (t < deadline) {
+      send_request(lc, rep.id);
+      inflight++;
+    }
+  }
+  close(lc->fd);
+  free(payload);
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double pct(const uint64_t *lat, size_t n, double p) {
+  size_t i = (size_t)(p / 100.0 * (double)(n - 1) + 0.5);
+  return lat[i] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+  pthread_t threads[MAX_CONNS];
+  load_conn *conns;
+  uint64_t *all;
+  uint64_t start;
+  uint64_t elapsed;
+  uint64_t errors = 0;
+  uint64_t bytes = 0;
+  size_t total = 0;
+  size_t at = 0;
+  int i;
+
+  parse_options(argc, argv);
+
+  conns = (load_conn *)calloc((size_t)nconns, sizeof(load_conn));
+  if (conns == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  start = now_ns();
+  deadline = start + (uint64_t)seconds * NSEC;
+  for (i = 0; i < nconns; i++) {
+    conns[i].index = i;
+    if (pthread_create(&threads[i], NULL, run_conn, &conns[i]) != 0) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < nconns; i++) {
+    pthread_join(threads[i], NULL);
+    total += conns[i].nlat;
+    errors += conns[i].errors;
+    bytes += conns[i].bytes;
+  }
+  elapsed = now_ns() - start;
+
+  all = (uint64_t *)malloc((total ? total : 1) * sizeof(uint64_t));
+  if (all == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < nconns; i++) {
+    memcpy(all + at, conns[i].lat, conns[i].nlat * sizeof(uint64_t));
+    at += conns[i].nlat;
+    free(conns[i].lat);
+  }
+  qsort(all, total, sizeof(uint64_t), cmp_u64);
+
+  printf("%d connections, depth %d, %.2f s\n", nconns, depth,
+      (double)elapsed / NSEC);
+  printf("  requests  = %12zu (%llu errors)\n", total,
+      (unsigned long long)errors);
+  printf("  qps       = %12.0f\n", total / ((double)elapsed / NSEC));
+  printf("  payload   = %12.2f MB/s\n",
+      bytes / ((double)elapsed / NSEC) / 1e6);
+  if (total > 0) {
+    printf("  p50       = %12.1f us\n", pct(all, total, 50.0));
+    printf("  p90       = %12.1f us\n", pct(all, total, 90.0));
+    printf("  p99       = %12.1f us\n", pct(all, total, 99.0));
+    printf("  p99.9     = %12.1f us\n", pct(all, total, 99.9));
+    printf("  max       = %12.1f us\n", all[total - 1] / 1000.0);
+  }
+  free(all);
+  free(conns);
+  return errors ? EXIT_FAILURE : 0;
+}
@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "minfs_common.h"
 #include "min.h"
 
@@ -17,13 +18,56 @@
 
 #define PATH_MAX 4096
 
+/* inode table blocks one coalesced inode read may span */
+#define ITABLE_CHUNK 64
+
+/* ls -l shows the year instead of the time past this age */
+#define SIX_MONTHS (182 * 24 * 60 * 60)
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+#define USAGE "usage: minls [ -v ] [ -l ] [ -k name|size|mtime ] [ -r ] " \
+  "[ -p num [ -s num ] ] imagefile [ path ]\n"
+
+enum sort_key {
+  SORT_NONE,
+  SORT_NAME,
+  SORT_SIZE,
+  SORT_MTIME
+};
+
+/* a directory's entries, one array per field so the sort and the
+   inode pass only touch what they need */
+typedef struct {
+  uint32_t n;
+  uint32_t cap;
+  uint32_t *ino;
+  uint32_t *name;
+  uint16_t *mode;
+  uint16_t *links;
+  uint16_t *uid;
+  uint16_t *gid;
+  uint32_t *size;
+  int32_t  *mtime;
+  uint64_t *key;
+  uint32_t *order;
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+} listing;
 
 typedef struct {
   FILE *image;
   fs_info *fs;
+  listing *list;
+  uint8_t *zone;
 } list_context;
 
 static int verbose = 0;
+static int longfmt = 0;
+static int reverse = 0;
+static int sortby = SORT_NONE;
 static int primary = -1;
 static int subpart = -1;
 const char *imagefile = NULL;
@@ -35,11 +79,29 @@ void parse_options(int argc, char *argv[]) {
   char *end;
   int remain;
   
-  while ((opt = getopt(argc, argv, "vp:s:")) != -1) {
+  while ((opt = getopt(argc, argv, "vlrk:p:s:")) != -1) {
     switch (opt) {
       case 'v':
         verbose = 1;
         break;
+      case 'l':
+        longfmt = 1;
+        break;
+      case 'r':
+        reverse = 1;
+        break;
+      case 'k':
+        if (strcmp(optarg, "name") == 0) {
+          sortby = SORT_NAME;
+        } else if (strcmp(optarg, "size") == 0) {
+          sortby = SORT_SIZE;
+        } else if (strcmp(optarg, "mtime") == 0) {
+          sortby = SORT_MTIME;
+        } else {
+          fprintf(stderr, "-k usage: k name|size|mtime\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
       case 'p':
         primary = strtol(optarg, &end, BASE);
         if (end == optarg || errno == ERANGE) {
@@ -65,9 +127,7 @@ void parse_options(int argc, char *argv[]) {
         }
         break;
       default:
-        fprintf(stderr,
-          "usage: minls [ -v ] [ -p num [ -s num ] ] imagefile"
-          " [ path ]\n");
+        fprintf(stderr, USAGE);
         exit(EXIT_FAILURE);
     }
   }
@@ -81,8 +141,7 @@ void parse_options(int argc, char *argv[]) {
   /* verify we have at least the imagefile argument */
   remain = argc - optind;
   if (remain <= 0) {
-    fprintf(stderr,
-      "usage: minls [ -v ] [ -p num [ -s num ] ] imagefile [ path ]\n");
+    fprintf(stderr, USAGE);
     exit(EXIT_FAILURE);
   }
   
@@ -199,32 +258,41 @@ char* normalize_path() {
   return normalized;
 }
 
-/* print file information */
-void print_file(minix_dirent *entry, fs_info *fs, FILE *image){
-  minix_inode file_node;
-  char name[SAFE_NAME_SIZE];
-  
-  memcpy(name, entry->name, SAFE_NAME_SIZE-1);
-  name[SAFE_NAME_SIZE-1] = '\0';
-
-  /* read inode data for this directory entry */
-  readinto(&file_node, get_inode_offset(entry->inode ,fs),
-    sizeof(minix_inode), image, NULL);
-  print_filetype(file_node.mode);
-  print_perms(file_node.mode & PERMSMASK);
-  if (printf("%9u %s\n", file_node.size, name) < 0) {
-    perror("printf");
+static void *grow(void *p, size_t count, size_t size) {
+  void *q = realloc(p, count * size);
+  if (q == NULL) {
+    perror("realloc");
     exit(EXIT_FAILURE);
   }
+  return q;
 }
 
+/* add an entry by inode and name. the inode fields are filled in later
+   by load_inodes */
+void add_entry(listing *l, uint32_t ino, const char *name, size_t len) {
+  if (l->n == l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 256;
+    l->ino = (uint32_t *)grow(l->ino, l->cap, sizeof(uint32_t));
+    l->name = (uint32_t *)grow(l->name, l->cap, sizeof(uint32_t));
+  }
+  if (l->names_len + len + 1 > l->names_cap) {
+    l->names_cap = (l->names_cap + len + 1) * 2;
+    l->names = (char *)grow(l->names, l->names_cap, 1);
+  }
+  memcpy(l->names + l->names_len, name, len);
+  l->names[l->names_len + len] = '\0';
+  l->ino[l->n] = ino;
+  l->name[l->n] = (uint32_t)l->names_len;
+  l->names_len += len + 1;
+  l->n++;
+}
 
-/* callback function invoked for each data zone in a directory */
+/* callback function invoked for each data zone in a directory. the
+   whole zone comes in with one read */
 int list_zone_callback(const zone_span *span, void *user){
   list_context *ctx = (list_context *)user;
   uint32_t num_entries;
   uint32_t i;
-  off_t offset;
   minix_dirent entry;
 
   if (span->is_hole){
@@ -233,44 +301,329 @@ int list_zone_callback(const zone_span *span, void *user){
 
   /* calculate how many directory entries fit in this zone */
   num_entries = span->length / sizeof(minix_dirent);
+  trace_kind(TRACE_DIRENT);
+  readinto(ctx->zone, span->image_off, num_entries * sizeof(minix_dirent),
+    ctx->image, NULL);
 
   for(i=0 ; i< num_entries; i++){
-    offset = span->image_off + (i * sizeof(minix_dirent));
-    readinto(&entry, offset, sizeof(entry), ctx->image, NULL);
+    memcpy(&entry, ctx->zone + i * sizeof(minix_dirent), sizeof(entry));
+    fix_dirent(ctx->fs, &entry);
 
-    if (entry.inode == 0){
+    if (entry.inode == 0 || entry.inode > ctx->fs->sb.ninodes){
       continue;
     }
 
-    print_file(&entry, ctx->fs, ctx->image);
+    add_entry(ctx->list, entry.inode, entry.name,
+      strnlen(entry.name, SAFE_NAME_SIZE-1));
   }
   return 0;
 }
 
+/* stable LSD radix sort of order[] by key[], both permuted together.
+   all byte histograms come from a single pass and bytes every key
+   shares are skipped */
+void radix_sort(uint64_t *key, uint32_t *order, uint32_t n, int bytes) {
+  uint32_t (*count)[RADIX_BUCKETS];
+  uint64_t *tkey;
+  uint32_t *torder;
+  uint64_t *src_key = key;
+  uint32_t *src_order = order;
+  uint32_t i;
+  int b;
+
+  if (n < 2) {
+    return;
+  }
+  count = calloc((size_t)bytes, sizeof(*count));
+  tkey = (uint64_t *)malloc((size_t)n * sizeof(uint64_t));
+  torder = (uint32_t *)malloc((size_t)n * sizeof(uint32_t));
+  if (count == NULL || tkey == NULL || torder == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < n; i++) {
+    for (b = 0; b < bytes; b++) {
+      count[b][(key[i] >> (b * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+    }
+  }
+
+  for (b = 0; b < bytes; b++) {
+    uint32_t sum = 0;
+    uint32_t d;
+    int shift = b * RADIX_BITS;
+    uint64_t *dst_key = src_key == key ? tkey : key;
+    uint32_t *dst_order = src_order == order ? torder : order;
+
+    if (count[b][(src_key[0] >> shift) & (RADIX_BUCKETS - 1)] == n) {
+      continue;
+    }
+    for (d = 0; d < RADIX_BUCKETS; d++) {
+      uint32_t c = count[b][d];
+      count[b][d] = sum;
+      sum += c;
+    }
+    for (i = 0; i < n; i++) {
+      uint32_t at = count[b][(src_key[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+      dst_key[at] = src_key[i];
+      dst_order[at] = src_order[i];
+    }
+    src_key = dst_key;
+    src_order = dst_order;
+  }
+
+  if (src_key != key) {
+    memcpy(key, src_key, (size_t)n * sizeof(uint64_t));
+    memcpy(order, src_order, (size_t)n * sizeof(uint32_t));
+  }
+  free(count);
+  free(tkey);
+  free(torder);
+}
+
+static void alloc_fields(listing *l) {
+  l->mode = (uint16_t *)grow(NULL, l->n, sizeof(uint16_t));
+  l->links = (uint16_t *)grow(NULL, l->n, sizeof(uint16_t));
+  l->uid = (uint16_t *)grow(NULL, l->n, sizeof(uint16_t));
+  l->gid = (uint16_t *)grow(NULL, l->n, sizeof(uint16_t));
+  l->size = (uint32_t *)grow(NULL, l->n, sizeof(uint32_t));
+  l->mtime = (int32_t *)grow(NULL, l->n, sizeof(int32_t));
+  l->key = (uint64_t *)grow(NULL, l->n, sizeof(uint64_t));
+  l->order = (uint32_t *)grow(NULL, l->n, sizeof(uint32_t));
+}
+
+static void set_fields(listing *l, uint32_t e, const minix_inode *in) {
+  l->mode[e] = in->mode;
+  l->links[e] = in->links;
+  l->uid[e] = in->uid;
+  l->gid[e] = in->gid;
+  l->size[e] = in->size;
+  l->mtime[e] = in->mtime;
+}
+
+/* read every entry's inode. inodes are visited in ascending order and
+   neighbours in the table share one read */
+void load_inodes(FILE *image, fs_info *fs, listing *l) {
+  uint32_t per_chunk = fs->ino_per_block * ITABLE_CHUNK;
+  minix_inode *chunk;
+  uint32_t i = 0;
+  uint32_t k;
+
+  alloc_fields(l);
+  chunk = (minix_inode *)grow(NULL, per_chunk, sizeof(minix_inode));
+
+  for (k = 0; k < l->n; k++) {
+    l->key[k] = l->ino[k];
+    l->order[k] = k;
+  }
+  radix_sort(l->key, l->order, l->n, sizeof(uint32_t));
+
+  while (i < l->n) {
+    uint32_t first = l->ino[l->order[i]];
+    uint32_t last = first;
+    uint32_t j = i;
+    while (j < l->n && l->ino[l->order[j]] - first < per_chunk) {
+      last = l->ino[l->order[j]];
+      j++;
+    }
+    trace_kind(TRACE_INODE);
+    readinto(chunk, get_inode_offset(first, fs),
+      (size_t)(last - first + 1) * sizeof(minix_inode), image, NULL);
+    for (k = i; k < j; k++) {
+      uint32_t e = l->order[k];
+      /* . and .. or hard links can share a slot, so convert a copy */
+      minix_inode in = chunk[l->ino[e] - first];
+      fix_inode(fs, &in);
+      set_fields(l, e, &in);
+    }
+    i = j;
+  }
+  free(chunk);
+}
+
+static const listing *tie_list;
+
+static int cmp_name(const void *a, const void *b) {
+  return strcmp(tie_list->names + tie_list->name[*(const uint32_t *)a],
+    tie_list->names + tie_list->name[*(const uint32_t *)b]);
+}
+
+/* big-endian first 8 bytes of the name, so integer order is strcmp
+   order on the prefix */
+static uint64_t name_key(const char *name) {
+  uint64_t k = 0;
+  int i;
+  for (i = 0; i < 8; i++) {
+    k <<= 8;
+    if (*name != '\0') {
+      k |= (uint8_t)*name++;
+    }
+  }
+  return k;
+}
+
+/* fill l->order with the listing order. without a key entries stay in
+   directory slot order, and entries with equal sizes or times keep it */
+void sort_listing(listing *l) {
+  uint32_t i;
+  int bytes = sizeof(uint32_t);
+
+  for (i = 0; i < l->n; i++) {
+    l->order[i] = i;
+  }
+  if (sortby == SORT_NONE) {
+    return;
+  }
+  for (i = 0; i < l->n; i++) {
+    switch (sortby) {
+      case SORT_NAME:
+        l->key[i] = name_key(l->names + l->name[i]);
+        break;
+      case SORT_SIZE:
+        l->key[i] = l->size[i];
+        break;
+      default:
+        l->key[i] = (uint32_t)l->mtime[i] ^ 0x80000000u;
+        break;
+    }
+  }
+  if (sortby == SORT_NAME) {
+    bytes = sizeof(uint64_t);
+  }
+  radix_sort(l->key, l->order, l->n, bytes);
+
+  /* names sharing all 8 key bytes still need the rest compared */
+  if (sortby == SORT_NAME) {
+    tie_list = l;
+    i = 0;
+    while (i < l->n) {
+      uint32_t j = i + 1;
+      while (j < l->n && l->key[j] == l->key[i]) {
+        j++;
+      }
+      if (j - i > 1 && (l->key[i] & 0xff) != 0) {
+        qsort(l->order + i, j - i, sizeof(uint32_t), cmp_name);
+      }
+      i = j;
+    }
+  }
+}
+
+static int digits(uint32_t v) {
+  int d = 1;
+  while (v >= 10) {
+    v /= 10;
+    d++;
+  }
+  return d;
+}
+
+/* print the listing, either the original short form or ls -l columns */
+void print_listing(const listing *l) {
+  int wlinks = 1;
+  int wuid = 1;
+  int wgid = 1;
+  int wsize = 1;
+  time_t now = time(NULL);
+  uint32_t i;
+
+  if (longfmt) {
+    /* localtime_r does not look at TZ again, so read it once here */
+    tzset();
+    for (i = 0; i < l->n; i++) {
+      if (digits(l->links[i]) > wlinks) {
+        wlinks = digits(l->links[i]);
+      }
+      if (digits(l->uid[i]) > wuid) {
+        wuid = digits(l->uid[i]);
+      }
+      if (digits(l->gid[i]) > wgid) {
+        wgid = digits(l->gid[i]);
+      }
+      if (digits(l->size[i]) > wsize) {
+        wsize = digits(l->size[i]);
+      }
+    }
+  }
+
+  for (i = 0; i < l->n; i++) {
+    uint32_t e = l->order[reverse ? l->n - 1 - i : i];
+    const char *name = l->names + l->name[e];
+    int rc;
+
+    print_filetype(l->mode[e]);
+    print_perms(l->mode[e] & PERMSMASK);
+    if (longfmt) {
+      char when[32];
+      time_t t = l->mtime[e];
+      struct tm tm;
+      const char *fmt = (t > now - SIX_MONTHS && t <= now) ?
+        "%b %e %H:%M" : "%b %e  %Y";
+      if (localtime_r(&t, &tm) == NULL ||
+          strftime(when, sizeof(when), fmt, &tm) == 0) {
+        strcpy(when, "?");
+      }
+      rc = printf("%*u %*u %*u %*u %s %s\n", wlinks, l->links[e],
+        wuid, l->uid[e], wgid, l->gid[e], wsize, l->size[e], when, name);
+    } else {
+      rc = printf("%9u %s\n", l->size[e], name);
+    }
+    if (rc < 0) {
+      perror("printf");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void free_listing(listing *l) {
+  free(l->ino);
+  free(l->name);
+  free(l->mode);
+  free(l->links);
+  free(l->uid);
+  free(l->gid);
+  free(l->size);
+  free(l->mtime);
+  free(l->key);
+  free(l->order);
+  free(l->names);
+}
+
 /* list contents of directory or display file information */
 void list_dir(FILE *image, minix_inode *dir_node, fs_info *fs) {
   list_context ctx;
+  listing list;
+
+  memset(&list, 0, sizeof(list));
   ctx.image = image;
   ctx.fs = fs;
+  ctx.list = &list;
   
   /* if target is a regular file, print its info and return */
   if ((dir_node->mode & FILEMASK) != DIRECTORY){
-    print_filetype(dir_node->mode);
-    print_perms(dir_node->mode & PERMSMASK);
     /* Skip leading slash when printing filename */
-    if (printf("%9u %s\n", dir_node->size, normalize_path()+1) < 0) {
+    const char *name = normalize_path()+1;
+    add_entry(&list, 0, name, strlen(name));
+    alloc_fields(&list);
+    set_fields(&list, 0, dir_node);
+  } else {
+    /* print directory header and iterate through entries */
+    if (printf("%s:\n", normalize_path()) < 0) {
       perror("printf");
       exit(EXIT_FAILURE);
     }
-    return;
-  }
-  
-  /* print directory header and iterate through entries */
-  if (printf("%s:\n", normalize_path()) < 0) {
-    perror("printf");
-    exit(EXIT_FAILURE);
+    ctx.zone = (uint8_t *)malloc(fs->zonesize);
+    if (ctx.zone == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    iterate_file_zones(image, fs, dir_node, list_zone_callback, &ctx);
+    free(ctx.zone);
+    load_inodes(image, fs, &list);
   }
-  iterate_file_zones(image, fs, dir_node, list_zone_callback, &ctx);
+
+  sort_listing(&list);
+  print_listing(&list);
+  free_listing(&list);
 }
 
 
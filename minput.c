@@ -0,0 +1,885 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "minfs_common.h"
+#include "min.h"
+
+#define BASE 10
+#define MAXPART 3
+#define MINPART 0
+
+#define PERMSMASK 07777
+#define DIRENT_NAME_SIZE 60
+
+#define INODE_MAP_BLOCK 2
+#define WORD_BITS 64
+#define ALL_USED (~(uint64_t)0)
+
+/* how many zones we gather before pushing them to the image */
+#define RUN_ZONES 64
+
+/* most pointer tables one new directory zone can need: a double
+   indirect table and a leaf under it */
+#define MAX_DIR_TABLES 2
+
+#define USAGE "usage: minput [ -v ] [ -p num [ -s num ] ] imagefile " \
+  "srcpath [ dstpath ]\n"
+
+/* in-memory copy of one of the on-disk bitmaps, 1 bits are in use */
+typedef struct {
+  uint8_t *bits;
+  off_t    off;
+  size_t   bytes;
+  uint32_t nbits;
+} bitmap;
+
+/* where a zone of the new file goes and what gets written there */
+typedef struct {
+  uint32_t  zone;
+  uint32_t *table;
+  uint64_t  file_off;
+} zone_plan;
+
+typedef struct {
+  FILE *image;
+  fs_info *fs;
+  const char *target_name;
+  uint32_t found_inode;
+  off_t free_slot;
+  int found;
+} dir_context;
+
+typedef struct {
+  uint64_t file_off;
+  off_t image_off;
+  int found;
+} locate_context;
+
+/* where a new directory entry goes and what the directory grows by.
+   zone is 0 when an existing slot is reused */
+typedef struct {
+  off_t slot;
+  uint32_t idx;
+  uint32_t zone;
+  uint32_t tables[MAX_DIR_TABLES];
+  uint32_t ntables;
+  int grow;
+} dirent_plan;
+
+static int verbose = 0;
+static int primary = -1;
+static int subpart = -1;
+const char *imagefile = NULL;
+const char *srcpath = NULL;
+char *dstpath = NULL;
+
+/* parse command line arguments */
+void parse_options(int argc, char *argv[]) {
+  int opt;
+  char *end;
+  int remain;
+
+  while ((opt = getopt(argc, argv, "vp:s:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'p':
+        primary = strtol(optarg, &end, BASE);
+        if (end == optarg || errno == ERANGE) {
+          fprintf(stderr, "-p usage: p <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        if (primary > MAXPART || primary < MINPART) {
+          fprintf(stderr,
+            "Partition %d out of range.  Must be 0..3.\n", primary);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 's':
+        subpart = strtol(optarg, &end, BASE);
+        if (end == optarg || errno == ERANGE) {
+          fprintf(stderr, "-s usage: s <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        if (subpart > MAXPART || subpart < MINPART) {
+          fprintf(stderr,
+            "Partition %d out of range.  Must be 0..3.\n", subpart);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  /* subpartition requires a primary partition */
+  if (subpart != -1 && primary == -1) {
+    fprintf(stderr, "usage: -s requires -p\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* need the image and the file to copy in */
+  remain = argc - optind;
+  if (remain < 2) {
+    fprintf(stderr, USAGE);
+    exit(EXIT_FAILURE);
+  }
+
+  imagefile = argv[optind++];
+  srcpath = argv[optind++];
+  if (remain >= 3) {
+    dstpath = strdup(argv[optind]);
+  } else {
+    dstpath = strdup("/");
+  }
+  if (dstpath == NULL) {
+    perror("strdup");
+    exit(EXIT_FAILURE);
+  }
+
+  if (verbose) {
+    printf("verbose:\n");
+    printf("imagefile: %s\n", imagefile);
+    printf("srcpath: %s\n", srcpath);
+    printf("dstpath: %s\n", dstpath);
+    printf("partition: %d\n", primary);
+    printf("subpartition: %d\n", subpart);
+  }
+}
+
+static void *xcalloc(size_t n, size_t size) {
+  void *p = calloc(n, size);
+  if (p == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/* read a bitmap into memory. bit 0 is reserved on disk so it is never
+   handed out, and everything past nbits counts as used. the map is kept
+   in 32 bit words, so an opposite endian image gets them swapped */
+static void load_bitmap(FILE *image, fs_info *fs, bitmap *bm, off_t off,
+    size_t bytes, uint32_t nbits) {
+  bm->off = off;
+  bm->bytes = bytes;
+  bm->nbits = nbits;
+  if ((size_t)nbits > bytes * 8) {
+    bm->nbits = (uint32_t)(bytes * 8);
+  }
+  bm->bits = (uint8_t *)xcalloc(bytes, 1);
+  trace_kind(TRACE_BITMAP);
+  readinto(bm->bits, off, bytes, image, NULL);
+  fix_table(fs, (uint32_t *)bm->bits, bytes / sizeof(uint32_t));
+  bm->bits[0] |= 1;
+}
+
+static void store_bitmap(FILE *image, fs_info *fs, bitmap *bm) {
+  fix_table(fs, (uint32_t *)bm->bits, bm->bytes / sizeof(uint32_t));
+  trace_kind(TRACE_BITMAP);
+  writeinto(bm->bits, bm->off, bm->bytes, image);
+  fix_table(fs, (uint32_t *)bm->bits, bm->bytes / sizeof(uint32_t));
+}
+
+static void mark_bits(bitmap *bm, uint32_t start, uint32_t len) {
+  uint32_t i;
+  for (i = start; i < start + len; i++) {
+    bm->bits[i / 8] |= (uint8_t)(1u << (i % 8));
+  }
+}
+
+/* one 64 bit word of the bitmap, bits past the end read as used */
+static uint64_t load_word(const bitmap *bm, uint32_t w) {
+  uint64_t v = ALL_USED;
+  size_t byte = (size_t)w * sizeof(uint64_t);
+  uint32_t first = w * WORD_BITS;
+
+  if (byte + sizeof(uint64_t) <= bm->bytes) {
+    memcpy(&v, bm->bits + byte, sizeof(uint64_t));
+  } else {
+    memcpy(&v, bm->bits + byte, bm->bytes - byte);
+  }
+  if (bm->nbits - first < WORD_BITS) {
+    v |= ALL_USED << (bm->nbits - first);
+  }
+  return v;
+}
+
+/* look for a free run a word at a time. full words are skipped and empty
+   words extend the run in one step, only mixed words get walked with ctz.
+   gives back the first run that fits want, otherwise the longest run */
+static uint32_t find_run(const bitmap *bm, uint32_t want,
+    uint32_t *start) {
+  uint32_t nwords = (bm->nbits + WORD_BITS - 1) / WORD_BITS;
+  uint32_t run_start = 0;
+  uint32_t run_len = 0;
+  uint32_t best_start = 0;
+  uint32_t best_len = 0;
+  uint32_t w;
+
+  for (w = 0; w < nwords; w++) {
+    uint64_t v = load_word(bm, w);
+    uint32_t bit = 0;
+
+    if (v == 0) {
+      if (run_len == 0) {
+        run_start = w * WORD_BITS;
+      }
+      run_len += WORD_BITS;
+    } else if (v == ALL_USED) {
+      if (run_len > best_len) {
+        best_start = run_start;
+        best_len = run_len;
+      }
+      run_len = 0;
+    } else {
+      while (bit < WORD_BITS) {
+        uint64_t rest = v >> bit;
+        uint32_t n;
+        if (rest & 1) {
+          /* used bits end the current run */
+          if (run_len > best_len) {
+            best_start = run_start;
+            best_len = run_len;
+          }
+          run_len = 0;
+          n = (uint32_t)__builtin_ctzll(~rest);
+        } else {
+          if (run_len == 0) {
+            run_start = w * WORD_BITS + bit;
+          }
+          n = rest ? (uint32_t)__builtin_ctzll(rest) : WORD_BITS - bit;
+          run_len += n;
+        }
+        if (run_len >= want) {
+          break;
+        }
+        bit += n;
+      }
+    }
+    if (run_len >= want) {
+      *start = run_start;
+      return want;
+    }
+  }
+  if (run_len > best_len) {
+    best_start = run_start;
+    best_len = run_len;
+  }
+  *start = best_start;
+  return best_len;
+}
+
+/* grab count zones, contiguous if the bitmap has a run that long and
+   otherwise as few long pieces as we can manage */
+static void alloc_zones(bitmap *zbm, fs_info *fs, uint32_t *zones,
+    uint32_t count) {
+  uint32_t got = 0;
+  while (got < count) {
+    uint32_t start;
+    uint32_t len = find_run(zbm, count - got, &start);
+    uint32_t i;
+    if (len == 0) {
+      fprintf(stderr, "minput: no free zones left on the image.\n");
+      exit(EXIT_FAILURE);
+    }
+    if (len > count - got) {
+      len = count - got;
+    }
+    mark_bits(zbm, start, len);
+    for (i = 0; i < len; i++) {
+      zones[got++] = fs->sb.firstdata + start + i - 1;
+    }
+    if (verbose) {
+      printf("verbose: extent of %u zones at zone %u\n", len,
+          fs->sb.firstdata + start - 1);
+    }
+  }
+}
+
+static uint32_t alloc_inode(bitmap *ibm) {
+  uint32_t start;
+  if (find_run(ibm, 1, &start) == 0) {
+    fprintf(stderr, "minput: no free inodes left on the image.\n");
+    exit(EXIT_FAILURE);
+  }
+  mark_bits(ibm, start, 1);
+  return start;
+}
+
+/* zero a freshly allocated zone so stale bytes never show up in it */
+static void clear_zone(FILE *image, fs_info *fs, uint32_t zone) {
+  uint8_t *zero = (uint8_t *)xcalloc(fs->zonesize, 1);
+  writeinto(zero, (off_t)zone * fs->zonesize, fs->zonesize, image);
+  free(zero);
+}
+
+/* point zone index idx of an inode at zone. tables are the new pointer
+   tables the path needs, already cleared, handed out top first */
+static void set_zone_ptr(FILE *image, fs_info *fs, minix_inode *in,
+    uint32_t idx, uint32_t zone, const uint32_t *tables) {
+  uint32_t ptrs = fs->ptrs_per_blk;
+  uint32_t table;
+  uint32_t disk = zone;
+  off_t slot;
+
+  fix_table(fs, &disk, 1);
+  if (idx < DIRECT_ZONES) {
+    in->zone[idx] = zone;
+    return;
+  }
+  idx -= DIRECT_ZONES;
+  trace_kind(TRACE_INDIRECT);
+  if (idx < ptrs) {
+    if (in->indirect == 0) {
+      in->indirect = *tables++;
+    }
+    slot = (off_t)in->indirect * fs->zonesize + idx * sizeof(uint32_t);
+    writeinto(&disk, slot, sizeof(disk), image);
+    return;
+  }
+  idx -= ptrs;
+  if (in->two_indirect == 0) {
+    in->two_indirect = *tables++;
+  }
+  slot = (off_t)in->two_indirect * fs->zonesize +
+      (idx / ptrs) * sizeof(uint32_t);
+  readinto(&table, slot, sizeof(table), image, NULL);
+  fix_table(fs, &table, 1);
+  if (table == 0) {
+    uint32_t disk_table;
+    table = *tables++;
+    disk_table = table;
+    fix_table(fs, &disk_table, 1);
+    writeinto(&disk_table, slot, sizeof(disk_table), image);
+  }
+  slot = (off_t)table * fs->zonesize + (idx % ptrs) * sizeof(uint32_t);
+  writeinto(&disk, slot, sizeof(disk), image);
+}
+
+/* look through a directory zone for a name and remember the first
+   empty slot while we are at it */
+int dir_zone_callback(const zone_span *span, void *user) {
+  dir_context *ctx = (dir_context *)user;
+  uint32_t num_entries;
+  char name[SAFE_NAME_SIZE];
+  minix_dirent entry;
+  uint32_t i;
+  off_t offset;
+
+  if (span->is_hole) {
+    return 0;
+  }
+
+  num_entries = span->length / sizeof(minix_dirent);
+  for (i = 0; i < num_entries; i++) {
+    offset = span->image_off + (i * sizeof(minix_dirent));
+    trace_kind(TRACE_DIRENT);
+    readinto(&entry, offset, sizeof(entry), ctx->image, NULL);
+    fix_dirent(ctx->fs, &entry);
+
+    if (entry.inode == 0) {
+      if (ctx->free_slot < 0) {
+        ctx->free_slot = offset;
+      }
+      continue;
+    }
+
+    memcpy(name, entry.name, sizeof(entry.name));
+    name[sizeof(entry.name)] = '\0';
+    if (strcmp(name, ctx->target_name) == 0) {
+      ctx->found_inode = entry.inode;
+      ctx->found = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int locate_callback(const zone_span *span, void *user) {
+  locate_context *ctx = (locate_context *)user;
+  if (span->file_off == ctx->file_off) {
+    ctx->found = !span->is_hole;
+    ctx->image_off = span->image_off;
+    return 1;
+  }
+  return 0;
+}
+
+static void write_inode(FILE *image, fs_info *fs, uint32_t ino,
+    const minix_inode *in) {
+  minix_inode disk = *in;
+  fix_inode(fs, &disk);
+  trace_kind(TRACE_INODE);
+  writeinto(&disk, get_inode_offset((int)ino, fs), sizeof(minix_inode),
+      image);
+}
+
+/* find where the new entry goes and reserve in zbm whatever the
+   directory has to grow by, so running out of room shows up before
+   anything is written. new tables come first in the run, in front of
+   the zone they map */
+static void plan_dirent(FILE *image, fs_info *fs, bitmap *zbm,
+    minix_inode *dir, const char *name, dirent_plan *dp) {
+  uint32_t ptrs = fs->ptrs_per_blk;
+  uint32_t idx = dir->size / fs->zonesize;
+  uint32_t within = dir->size % fs->zonesize;
+  uint32_t got[MAX_DIR_TABLES + 1];
+  dir_context ctx;
+  uint32_t i;
+
+  memset(dp, 0, sizeof(*dp));
+  ctx.image = image;
+  ctx.fs = fs;
+  ctx.target_name = name;
+  ctx.found_inode = 0;
+  ctx.free_slot = -1;
+  ctx.found = 0;
+  iterate_file_zones(image, fs, dir, dir_zone_callback, &ctx);
+  if (ctx.free_slot >= 0) {
+    dp->slot = ctx.free_slot;
+    return;
+  }
+
+  if (within != 0) {
+    locate_context loc;
+    loc.file_off = (uint64_t)idx * fs->zonesize;
+    loc.found = 0;
+    iterate_file_zones(image, fs, dir, locate_callback, &loc);
+    if (!loc.found) {
+      fprintf(stderr, "minput: directory has a hole at its end.\n");
+      exit(EXIT_FAILURE);
+    }
+    dp->slot = loc.image_off + within;
+    dp->grow = 1;
+    return;
+  }
+
+  /* a new zone, and the pointer tables on its path that are missing */
+  dp->idx = idx;
+  if (idx >= DIRECT_ZONES) {
+    i = idx - DIRECT_ZONES;
+    if (i < ptrs) {
+      dp->ntables = dir->indirect == 0;
+    } else {
+      i -= ptrs;
+      if (i >= ptrs * ptrs) {
+        fprintf(stderr, "minput: directory too large.\n");
+        exit(EXIT_FAILURE);
+      }
+      if (dir->two_indirect == 0) {
+        dp->ntables = 2;
+      } else {
+        uint32_t leaf;
+        trace_kind(TRACE_INDIRECT);
+        readinto(&leaf, (off_t)dir->two_indirect * fs->zonesize +
+            (i / ptrs) * sizeof(uint32_t), sizeof(leaf), image, NULL);
+        fix_table(fs, &leaf, 1);
+        dp->ntables = leaf == 0;
+      }
+    }
+  }
+  alloc_zones(zbm, fs, got, dp->ntables + 1);
+  for (i = 0; i < dp->ntables; i++) {
+    dp->tables[i] = got[i];
+  }
+  dp->zone = got[dp->ntables];
+  dp->slot = (off_t)dp->zone * fs->zonesize;
+  dp->grow = 1;
+}
+
+/* hook ino into dir at the slot plan_dirent picked */
+static void add_dirent(FILE *image, fs_info *fs, uint32_t dir_ino,
+    minix_inode *dir, const char *name, uint32_t ino,
+    const dirent_plan *dp) {
+  minix_dirent entry;
+  uint32_t i;
+
+  if (dp->zone != 0) {
+    trace_kind(TRACE_INDIRECT);
+    for (i = 0; i < dp->ntables; i++) {
+      clear_zone(image, fs, dp->tables[i]);
+    }
+    trace_kind(TRACE_DIRENT);
+    clear_zone(image, fs, dp->zone);
+    set_zone_ptr(image, fs, dir, dp->idx, dp->zone, dp->tables);
+  }
+  if (dp->grow) {
+    dir->size += sizeof(minix_dirent);
+  }
+
+  memset(&entry, 0, sizeof(entry));
+  entry.inode = ino;
+  fix_dirent(fs, &entry);
+  memcpy(entry.name, name, strlen(name));
+  trace_kind(TRACE_DIRENT);
+  writeinto(&entry, dp->slot, sizeof(entry), image);
+
+  dir->mtime = dir->ctime = (int32_t)time(NULL);
+  write_inode(image, fs, dir_ino, dir);
+}
+
+/* lay the file out in the order it will be read back: the direct zones,
+   then each pointer table right in front of the zones it maps */
+static uint32_t plan_layout(fs_info *fs, uint64_t size,
+    zone_plan **out) {
+  uint32_t ptrs = fs->ptrs_per_blk;
+  uint32_t ndata = (uint32_t)((size + fs->zonesize - 1) / fs->zonesize);
+  uint32_t ntables = 0;
+  uint32_t rest;
+  uint32_t total;
+  uint32_t d = 0;
+  uint32_t n = 0;
+  uint32_t i;
+  zone_plan *plan;
+
+  if (ndata > DIRECT_ZONES) {
+    ntables++;
+  }
+  if (ndata > DIRECT_ZONES + ptrs) {
+    rest = ndata - DIRECT_ZONES - ptrs;
+    if (rest > ptrs * ptrs) {
+      fprintf(stderr, "minput: file too large for this filesystem.\n");
+      exit(EXIT_FAILURE);
+    }
+    ntables += 1 + (rest + ptrs - 1) / ptrs;
+  }
+  total = ndata + ntables;
+  plan = (zone_plan *)xcalloc(total ? total : 1, sizeof(zone_plan));
+
+  for (i = 0; i < DIRECT_ZONES && d < ndata; i++, d++) {
+    plan[n++].file_off = (uint64_t)d * fs->zonesize;
+  }
+  if (d < ndata) {
+    plan[n++].table = (uint32_t *)xcalloc(fs->zonesize, 1);
+    for (i = 0; i < ptrs && d < ndata; i++, d++) {
+      plan[n++].file_off = (uint64_t)d * fs->zonesize;
+    }
+  }
+  if (d < ndata) {
+    plan[n++].table = (uint32_t *)xcalloc(fs->zonesize, 1);
+    while (d < ndata) {
+      plan[n++].table = (uint32_t *)xcalloc(fs->zonesize, 1);
+      for (i = 0; i < ptrs && d < ndata; i++, d++) {
+        plan[n++].file_off = (uint64_t)d * fs->zonesize;
+      }
+    }
+  }
+  *out = plan;
+  return total;
+}
+
+/* now that the zone numbers are known, fill in the inode and tables */
+static void fill_pointers(minix_inode *in, zone_plan *plan,
+    uint32_t total) {
+  uint32_t *table = NULL;
+  uint32_t *top = NULL;
+  uint32_t tops = 0;
+  uint32_t filled = 0;
+  uint32_t d = 0;
+  uint32_t n;
+
+  for (n = 0; n < total; n++) {
+    if (plan[n].table != NULL) {
+      if (d == DIRECT_ZONES) {
+        in->indirect = plan[n].zone;
+      } else if (top == NULL) {
+        in->two_indirect = plan[n].zone;
+        top = plan[n].table;
+        continue;
+      } else {
+        top[tops++] = plan[n].zone;
+      }
+      table = plan[n].table;
+      filled = 0;
+      continue;
+    }
+    if (d < DIRECT_ZONES) {
+      in->zone[d] = plan[n].zone;
+    } else {
+      table[filled++] = plan[n].zone;
+    }
+    d++;
+  }
+}
+
+/* write every zone of the plan, batching physically adjacent zones into
+   one write so a contiguous file goes down as one long stream. a batch
+   holds only tables or only data so a trace can tell them apart */
+static void write_zones(FILE *image, fs_info *fs, FILE *src,
+    zone_plan *plan, uint32_t total, uint64_t size) {
+  uint8_t *buf = (uint8_t *)xcalloc(RUN_ZONES, fs->zonesize);
+  uint32_t batched = 0;
+  uint32_t first = 0;
+  uint32_t n;
+  int kind = TRACE_DATA;
+
+  for (n = 0; n < total; n++) {
+    uint8_t *dst;
+    int want_kind = plan[n].table != NULL ? TRACE_INDIRECT : TRACE_DATA;
+    if (batched > 0 && (batched == RUN_ZONES ||
+          plan[n].zone != first + batched || want_kind != kind)) {
+      trace_kind(kind);
+      writeinto(buf, (off_t)first * fs->zonesize,
+          (size_t)batched * fs->zonesize, image);
+      batched = 0;
+    }
+    if (batched == 0) {
+      first = plan[n].zone;
+      kind = want_kind;
+    }
+    dst = buf + (size_t)batched * fs->zonesize;
+    memset(dst, 0, fs->zonesize);
+    if (plan[n].table != NULL) {
+      memcpy(dst, plan[n].table, fs->sb.blocksize);
+      fix_table(fs, (uint32_t *)dst, fs->ptrs_per_blk);
+    } else {
+      uint64_t want = size - plan[n].file_off;
+      if (want > fs->zonesize) {
+        want = fs->zonesize;
+      }
+      if (fread(dst, 1, (size_t)want, src) != want) {
+        if (ferror(src)) {
+          perror("fread");
+        } else {
+          fprintf(stderr, "%s: file shrank while copying.\n", srcpath);
+        }
+        exit(EXIT_FAILURE);
+      }
+    }
+    batched++;
+  }
+  if (batched > 0) {
+    trace_kind(kind);
+    writeinto(buf, (off_t)first * fs->zonesize,
+        (size_t)batched * fs->zonesize, image);
+  }
+  free(buf);
+}
+
+/* walk path down from the root like resolve_path does, but keep the
+   inode number and give back 0 instead of bailing when it is missing */
+static uint32_t walk_path(FILE *image, fs_info *fs, const char *path,
+    minix_inode *out) {
+  char *path_copy = strdup(path);
+  char *cur_name;
+  uint32_t ino = 1;
+  dir_context ctx;
+
+  if (path_copy == NULL) {
+    perror("strdup");
+    exit(EXIT_FAILURE);
+  }
+  if (read_inode(image, fs, ino, out) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  cur_name = strtok(path_copy, "/");
+  while (cur_name != NULL) {
+    if ((out->mode & FILEMASK) != DIRECTORY) {
+      fprintf(stderr, "%s: not a directory.\n", cur_name);
+      exit(EXIT_FAILURE);
+    }
+    ctx.image = image;
+    ctx.fs = fs;
+    ctx.target_name = cur_name;
+    ctx.found_inode = 0;
+    ctx.free_slot = -1;
+    ctx.found = 0;
+    iterate_file_zones(image, fs, out, dir_zone_callback, &ctx);
+    if (!ctx.found) {
+      ino = 0;
+      break;
+    }
+    ino = ctx.found_inode;
+    if (read_inode(image, fs, ino, out) != 0) {
+      exit(EXIT_FAILURE);
+    }
+    cur_name = strtok(NULL, "/");
+  }
+  free(path_copy);
+  return ino;
+}
+
+/* work out which directory the file goes in and under what name. an
+   existing directory or a trailing slash keeps the name of srcpath.
+   the name is checked here, before anything is written to the image */
+static char *split_dest(FILE *image, fs_info *fs, minix_inode *dir,
+    uint32_t *dir_ino) {
+  const char *base;
+  char *slash;
+  char *name;
+  dir_context ctx;
+
+  base = strrchr(srcpath, '/');
+  base = base ? base + 1 : srcpath;
+
+  *dir_ino = walk_path(image, fs, dstpath, dir);
+  if (*dir_ino != 0) {
+    if ((dir->mode & FILEMASK) != DIRECTORY) {
+      fprintf(stderr, "%s: file exists.\n", dstpath);
+      exit(EXIT_FAILURE);
+    }
+    name = strdup(base);
+  } else {
+    slash = strrchr(dstpath, '/');
+    if (slash == NULL) {
+      name = strdup(dstpath);
+      *dir_ino = walk_path(image, fs, "/", dir);
+    } else {
+      name = strdup(slash + 1);
+      *slash = '\0';
+      *dir_ino = walk_path(image, fs, dstpath, dir);
+      *slash = '/';
+    }
+    if (*dir_ino == 0) {
+      fprintf(stderr, "%s: file not found.\n", dstpath);
+      exit(EXIT_FAILURE);
+    }
+    if ((dir->mode & FILEMASK) != DIRECTORY) {
+      fprintf(stderr, "%s: not a directory.\n", dstpath);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (name == NULL) {
+    perror("strdup");
+    exit(EXIT_FAILURE);
+  }
+  if (strlen(name) > DIRENT_NAME_SIZE) {
+    fprintf(stderr, "%s: name too long.\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  ctx.image = image;
+  ctx.fs = fs;
+  ctx.target_name = name;
+  ctx.found_inode = 0;
+  ctx.free_slot = -1;
+  ctx.found = 0;
+  iterate_file_zones(image, fs, dir, dir_zone_callback, &ctx);
+  if (ctx.found) {
+    fprintf(stderr, "%s: file exists.\n", name);
+    exit(EXIT_FAILURE);
+  }
+  return name;
+}
+
+int main(int argc, char *argv[]) {
+  FILE *image = NULL;
+  FILE *src = NULL;
+  fs_info fs;
+  minix_inode dir;
+  minix_inode node;
+  uint32_t dir_ino;
+  uint32_t ino;
+  uint32_t total;
+  uint32_t *zones;
+  uint32_t n;
+  zone_plan *plan;
+  bitmap ibm;
+  bitmap zbm;
+  dirent_plan dp;
+  struct stat st;
+  char *name;
+  off_t map_start;
+
+  parse_options(argc, argv);
+
+  src = fopen(srcpath, "rb");
+  if (src == NULL) {
+    perror(srcpath);
+    exit(EXIT_FAILURE);
+  }
+  if (fstat(fileno(src), &st) != 0) {
+    perror("fstat");
+    exit(EXIT_FAILURE);
+  }
+  if (!S_ISREG(st.st_mode)) {
+    fprintf(stderr, "%s: not a regular file.\n", srcpath);
+    exit(EXIT_FAILURE);
+  }
+
+  /* open the filesystem image file for reading and writing */
+  image = fopen(imagefile, "r+b");
+  if (image == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+
+  init_fs(image, &fs, primary, subpart);
+  if (verbose) {
+    print_superblock(&fs);
+  }
+  if ((uint64_t)st.st_size > fs.sb.max_file) {
+    fprintf(stderr, "%s: file too large for this filesystem.\n",
+        srcpath);
+    exit(EXIT_FAILURE);
+  }
+
+  name = split_dest(image, &fs, &dir, &dir_ino);
+
+  map_start = (off_t)INODE_MAP_BLOCK * fs.sb.blocksize;
+  load_bitmap(image, &fs, &ibm, map_start,
+      (size_t)fs.sb.i_blocks * fs.sb.blocksize, fs.sb.ninodes + 1);
+  load_bitmap(image, &fs, &zbm,
+      map_start + (off_t)fs.sb.i_blocks * fs.sb.blocksize,
+      (size_t)fs.sb.z_blocks * fs.sb.blocksize,
+      fs.sb.zones - fs.sb.firstdata + 1);
+
+  /* every allocation happens before the first write, so running out of
+     zones or inodes leaves the image as it was. the directory may need
+     a new zone of its own */
+  plan_dirent(image, &fs, &zbm, &dir, name, &dp);
+  ino = alloc_inode(&ibm);
+
+  /* pick the zones for the whole file in one go so it stays in one
+     piece whenever the bitmap has room for that */
+  memset(&node, 0, sizeof(node));
+  total = plan_layout(&fs, (uint64_t)st.st_size, &plan);
+  zones = (uint32_t *)xcalloc(total ? total : 1, sizeof(uint32_t));
+  alloc_zones(&zbm, &fs, zones, total);
+  for (n = 0; n < total; n++) {
+    plan[n].zone = zones[n];
+  }
+  fill_pointers(&node, plan, total);
+  write_zones(image, &fs, src, plan, total, (uint64_t)st.st_size);
+
+  node.mode = REGFILE | (st.st_mode & PERMSMASK);
+  node.links = 1;
+  node.uid = (uint16_t)st.st_uid;
+  node.gid = (uint16_t)st.st_gid;
+  node.size = (uint32_t)st.st_size;
+  node.atime = node.mtime = node.ctime = (int32_t)time(NULL);
+  write_inode(image, &fs, ino, &node);
+
+  add_dirent(image, &fs, dir_ino, &dir, name, ino, &dp);
+  store_bitmap(image, &fs, &ibm);
+  store_bitmap(image, &fs, &zbm);
+
+  if (verbose) {
+    printf("verbose: wrote %s as inode %u in %u zones\n", name, ino,
+        total);
+  }
+
+  for (n = 0; n < total; n++) {
+    free(plan[n].table);
+  }
+  free(plan);
+  free(zones);
+  free(ibm.bits);
+  free(zbm.bits);
+  free(name);
+  free(dstpath);
+
+  if (fclose(src) != 0 || fclose(image) != 0) {
+    perror("fclose");
+    exit(EXIT_FAILURE);
+  }
+  return 0;
+}
@@ -0,0 +1,556 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "mintrace.h"
+
+#define BASE 10
+
+#define MAX_CONFIGS 16
+#define DEFAULT_BLOCK 4096
+#define DEFAULT_SEEK_US 4000
+#define DEFAULT_MBPS 150
+
+#define NO_SLOT (-1)
+
+#define USAGE "usage: minreplay [ -b blocksize ] [ -c blocks,... ] " \
+  "[ -e lru|fifo|clock,... ] [ -r blocks,... ] [ -S seek_us ] " \
+  "[ -T MB/s ] tracefile\n"
+
+enum policy {
+  POLICY_LRU,
+  POLICY_FIFO,
+  POLICY_CLOCK,
+  POLICIES
+};
+
+static const char *policy_names[POLICIES] = { "lru", "fifo", "clock" };
+
+static const char *kind_names[TRACE_KINDS] = {
+  "other", "part", "super", "bitmap", "inode", "dirent", "indir", "data"
+};
+
+/* one cached block. prev and next chain the lru/fifo list, clock only
+   looks at ref */
+typedef struct {
+  uint64_t block;
+  int32_t prev;
+  int32_t next;
+  uint8_t ref;
+  uint8_t prefetched;
+} cache_slot;
+
+typedef struct {
+  int policy;
+  uint32_t cap;
+  uint32_t used;
+  cache_slot *slots;
+  int32_t head;
+  int32_t tail;
+  uint32_t hand;
+  int32_t *table;
+  uint64_t mask;
+} cache;
+
+/* what one configuration cost */
+typedef struct {
+  uint64_t access[TRACE_KINDS];
+  uint64_t hits[TRACE_KINDS];
+  uint64_t dev_reads;
+  uint64_t dev_writes;
+  uint64_t dev_blocks;
+  uint64_t seeks;
+  uint64_t prefetched;
+  uint64_t prefetch_used;
+  double dev_us;
+} replay_stats;
+
+/* where the simulated head is and what moving it costs */
+typedef struct {
+  uint64_t pos;
+  double seek_us;
+  double block_us;
+} device;
+
+static uint32_t blocksize = DEFAULT_BLOCK;
+static uint32_t block_shift = 12;
+static uint32_t sizes[MAX_CONFIGS] = { 64, 256, 1024, 4096 };
+static int nsizes = 4;
+static uint32_t aheads[MAX_CONFIGS] = { 0, 4, 16 };
+static int naheads = 3;
+static int policies[POLICIES] = { POLICY_LRU, POLICY_FIFO, POLICY_CLOCK };
+static int npolicies = POLICIES;
+static double seek_us = DEFAULT_SEEK_US;
+static double mbps = DEFAULT_MBPS;
+static const char *tracefile = NULL;
+
+static long number(const char *arg, const char *flag, long lo, long hi) {
+  char *end;
+  long v;
+  errno = 0;
+  v = strtol(arg, &end, BASE);
+  if (end == arg || *end != '\0' || errno == ERANGE || v < lo || v > hi) {
+    fprintf(stderr, "-%s usage: %s <%ld..%ld>\n", flag, flag, lo, hi);
+    exit(EXIT_FAILURE);
+  }
+  return v;
+}
+
+/* comma separated numbers into vals, returns how many */
+static int number_list(char *arg, const char *flag, uint32_t *vals,
+    long hi) {
+  int n = 0;
+  char *tok;
+  for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (n == MAX_CONFIGS) {
+      fprintf(stderr, "-%s: at most %d values\n", flag, MAX_CONFIGS);
+      exit(EXIT_FAILURE);
+    }
+    vals[n++] = (uint32_t)number(tok, flag, 0, hi);
+  }
+  if (n == 0) {
+    fprintf(stderr, USAGE);
+    exit(EXIT_FAILURE);
+  }
+  return n;
+}
+
+/* parse command line arguments */
+void parse_options(int argc, char *argv[]) {
+  int opt;
+  char *tok;
+
+  while ((opt = getopt(argc, argv, "b:c:e:r:S:T:")) != -1) {
+    switch (opt) {
+      case 'b':
+        blocksize = (uint32_t)number(optarg, "b", 512, 1 << 20);
+        if (blocksize & (blocksize - 1)) {
+          fprintf(stderr, "-b: block size must be a power of two\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'c':
+        nsizes = number_list(optarg, "c", sizes, 1 << 24);
+        break;
+      case 'r':
+        naheads = number_list(optarg, "r", aheads, 1 << 16);
+        break;
+      case 'e':
+        npolicies = 0;
+        for (tok = strtok(optarg, ","); tok != NULL;
+            tok = strtok(NULL, ",")) {
+          int p;
+          for (p = 0; p < POLICIES; p++) {
+            if (strcmp(tok, policy_names[p]) == 0) {
+              break;
+            }
+          }
+          if (p == POLICIES || npolicies == POLICIES) {
+            fprintf(stderr, "-e usage: e lru|fifo|clock,...\n");
+            exit(EXIT_FAILURE);
+          }
+          policies[npolicies++] = p;
+        }
+        break;
+      case 'S':
+        seek_us = (double)number(optarg, "S", 0, 1000000);
+        break;
+      case 'T':
+        mbps = (double)number(optarg, "T", 1, 1000000);
+        break;
+      default:
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (argc - optind != 1) {
+    fprintf(stderr, USAGE);
+    exit(EXIT_FAILURE);
+  }
+  tracefile = argv[optind];
+  block_shift = (uint32_t)__builtin_ctz(blocksize);
+}
+
+static mintrace_record *load_trace(const char *path, size_t *count) {
+  FILE *f = fopen(path, "r");
+  mintrace_header hdr;
+  mintrace_record *recs = NULL;
+  size_t cap = 0;
+  size_t n = 0;
+
+  if (f == NULL) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      hdr.magic != MINTRACE_MAGIC || hdr.version != MINTRACE_VERSION ||
+      hdr.record_size != sizeof(mintrace_record)) {
+    fprintf(stderr, "%s: not a minfs trace.\n", path);
+    exit(EXIT_FAILURE);
+  }
+  for (;;) {
+    size_t got;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 65536;
+      recs = (mintrace_record *)realloc(recs,
+          cap * sizeof(mintrace_record));
+      if (recs == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    got = fread(recs + n, sizeof(mintrace_record), cap - n, f);
+    n += got;
+    if (got == 0) {
+      break;
+    }
+  }
+  if (ferror(f)) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  fclose(f);
+  *count = n;
+  return recs;
+}
+
+static uint64_t hash_block(uint64_t b) {
+  b ^= b >> 33;
+  b *= 0xff51afd7ed558ccdULL;
+  b ^= b >> 33;
+  return b;
+}
+
+static void cache_init(cache *c, int policy, uint32_t cap) {
+  uint64_t tsize = 16;
+  memset(c, 0, sizeof(*c));
+  c->policy = policy;
+  c->cap = cap;
+  c->head = c->tail = NO_SLOT;
+  while (tsize < (uint64_t)cap * 2) {
+    tsize <<= 1;
+  }
+  c->mask = tsize - 1;
+  c->slots = (cache_slot *)calloc(cap ? cap : 1, sizeof(cache_slot));
+  c->table = (int32_t *)malloc(tsize * sizeof(int32_t));
+  if (c->slots == NULL || c->table == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(c->table, 0xff, tsize * sizeof(int32_t));
+}
+
+static void cache_free(cache *c) {
+  free(c->slots);
+  free(c->table);
+}
+
+static int32_t cache_find(const cache *c, uint64_t block) {
+  uint64_t i = hash_block(block) & c->mask;
+  while (c->table[i] != NO_SLOT) {
+    if (c->slots[c->table[i]].block == block) {
+      return c->table[i];
+    }
+    i = (i + 1) & c->mask;
+  }
+  return NO_SLOT;
+}
+
+/* linear probing delete: pull later entries of the cluster back so
+   lookups never stop early */
+static void table_remove(cache *c, uint64_t block) {
+  uint64_t i = hash_block(block) & c->mask;
+  uint64_t j;
+  while (c->slots[c->table[i]].block != block) {
+    i = (i + 1) & c->mask;
+  }
+  j = i;
+  for (;;) {
+    uint64_t home;
+    j = (j + 1) & c->mask;
+    if (c->table[j] == NO_SLOT) {
+      break;
+    }
+    home = hash_block(c->slots[c->table[j]].block) & c->mask;
+    if (((j - home) & c->mask) >= ((j - i) & c->mask)) {
+      c->table[i] = c->table[j];
+      i = j;
+    }
+  }
+  c->table[i] = NO_SLOT;
+}
+
+static void table_insert(cache *c, int32_t slot) {
+  uint64_t i = hash_block(c->slots[slot].block) & c->mask;
+  while (c->table[i] != NO_SLOT) {
+    i = (i + 1) & c->mask;
+  }
+  c->table[i] = slot;
+}
+
+static void list_unlink(cache *c, int32_t s) {
+  cache_slot *e = &c->slots[s];
+  if (e->prev != NO_SLOT) {
+    c->slots[e->prev].next = e->next;
+  } else {
+    c->head = e->next;
+  }
+  if (e->next != NO_SLOT) {
+    c->slots[e->next].prev = e->prev;
+  } else {
+    c->tail = e->prev;
+  }
+}
+
+static void list_push(cache *c, int32_t s) {
+  cache_slot *e = &c->slots[s];
+  e->prev = NO_SLOT;
+  e->next = c->head;
+  if (c->head != NO_SLOT) {
+    c->slots[c->head].prev = s;
+  } else {
+    c->tail = s;
+  }
+  c->head = s;
+}
+
+static void cache_touch(cache *c, int32_t s) {
+  switch (c->policy) {
+    case POLICY_LRU:
+      if (c->head != s) {
+        list_unlink(c, s);
+        list_push(c, s);
+      }
+      break;
+    case POLICY_CLOCK:
+      c->slots[s].ref = 1;
+      break;
+    default:
+      break;
+  }
+}
+
+/* pick the slot to reuse. lru and fifo both drop the list tail, clock
+   sweeps for a block nobody has used since the last pass */
+static int32_t cache_victim(cache *c) {
+  int32_t s;
+  if (c->used < c->cap) {
+    return (int32_t)c->used++;
+  }
+  if (c->policy == POLICY_CLOCK) {
+    while (c->slots[c->hand].ref) {
+      c->slots[c->hand].ref = 0;
+      c->hand = (c->hand + 1) % c->cap;
+    }
+    s = (int32_t)c->hand;
+    c->hand = (c->hand + 1) % c->cap;
+  } else {
+    s = c->tail;
+    list_unlink(c, s);
+  }
+  table_remove(c, c->slots[s].block);
+  return s;
+}
+
+static void cache_insert(cache *c, uint64_t block, int prefetched) {
+  int32_t s;
+  if (c->cap == 0) {
+    return;
+  }
+  s = cache_victim(c);
+  c->slots[s].block = block;
+  c->slots[s].ref = (uint8_t)!prefetched;
+  c->slots[s].prefetched = (uint8_t)prefetched;
+  table_insert(c, s);
+  if (c->policy != POLICY_CLOCK) {
+    list_push(c, s);
+  }
+}
+
+static void device_io(device *dev, replay_stats *st, uint64_t first,
+    uint64_t n) {
+  if (first != dev->pos) {
+    st->dev_us += dev->seek_us;
+    st->seeks++;
+  }
+  st->dev_us += (double)n * dev->block_us;
+  st->dev_blocks += n;
+  dev->pos = first + n;
+}
+
+/* one read record. each missing run goes to the device as one request,
+   stretched by the readahead window past the last block asked for */
+static void replay_read(cache *c, device *dev, replay_stats *st,
+    uint64_t first, uint64_t last, int kind, uint32_t ahead) {
+  uint64_t b = first;
+
+  while (b <= last) {
+    int32_t s = cache_find(c, b);
+    uint64_t end;
+    uint64_t stop;
+    uint64_t x;
+
+    st->access[kind]++;
+    if (s != NO_SLOT) {
+      st->hits[kind]++;
+      if (c->slots[s].prefetched) {
+        c->slots[s].prefetched = 0;
+        st->prefetch_used++;
+      }
+      cache_touch(c, s);
+      b++;
+      continue;
+    }
+    end = b + 1;
+    while (end <= last && cache_find(c, end) == NO_SLOT) {
+      st->access[kind]++;
+      end++;
+    }
+    stop = end;
+    if (end > last) {
+      while (stop < last + 1 + ahead && cache_find(c, stop) == NO_SLOT) {
+        stop++;
+      }
+    }
+    st->dev_reads++;
+    device_io(dev, st, b, stop - b);
+    for (x = b; x < stop; x++) {
+      cache_insert(c, x, x >= end);
+    }
+    st->prefetched += stop - end;
+    b = end;
+  }
+}
+
+/* writes go straight through and leave the blocks cached */
+static void replay_write(cache *c, device *dev, replay_stats *st,
+    uint64_t first, uint64_t last) {
+  uint64_t b;
+  st->dev_writes++;
+  device_io(dev, st, first, last - first + 1);
+  for (b = first; b <= last; b++) {
+    int32_t s = cache_find(c, b);
+    if (s != NO_SLOT) {
+      c->slots[s].prefetched = 0;
+      cache_touch(c, s);
+    } else {
+      cache_insert(c, b, 0);
+    }
+  }
+}
+
+static void replay(const mintrace_record *recs, size_t n, int policy,
+    uint32_t cap, uint32_t ahead, replay_stats *st) {
+  cache c;
+  device dev;
+  size_t i;
+
+  memset(st, 0, sizeof(*st));
+  cache_init(&c, policy, cap);
+  dev.pos = UINT64_MAX;
+  dev.seek_us = seek_us;
+  dev.block_us = (double)blocksize / mbps;
+  for (i = 0; i < n; i++) {
+    uint64_t first = recs[i].offset >> block_shift;
+    uint64_t last;
+    int kind = recs[i].kind & ~TRACE_WRITE;
+    if (recs[i].length == 0) {
+      continue;
+    }
+    if (kind >= TRACE_KINDS) {
+      kind = TRACE_OTHER;
+    }
+    last = (recs[i].offset + recs[i].length - 1) >> block_shift;
+    if (recs[i].kind & TRACE_WRITE) {
+      replay_write(&c, &dev, st, first, last);
+    } else {
+      replay_read(&c, &dev, st, first, last, kind, ahead);
+    }
+  }
+  cache_free(&c);
+}
+
+static double pct(uint64_t part, uint64_t whole) {
+  return whole ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+/* trace totals and which kinds show up, so empty columns are skipped */
+static void summarize(const mintrace_record *recs, size_t n,
+    int *present) {
+  uint64_t reads = 0;
+  uint64_t bytes = 0;
+  size_t i;
+  int k;
+
+  memset(present, 0, TRACE_KINDS * sizeof(int));
+  for (i = 0; i < n; i++) {
+    int kind = recs[i].kind & ~TRACE_WRITE;
+    if (!(recs[i].kind & TRACE_WRITE)) {
+      reads++;
+      present[kind < TRACE_KINDS ? kind : TRACE_OTHER] = 1;
+    }
+    bytes += recs[i].length;
+  }
+  printf("%s: %zu records, %llu reads, %llu writes, %.2f MB\n", tracefile,
+      n, (unsigned long long)reads, (unsigned long long)(n - reads),
+      (double)bytes / 1e6);
+  printf("block %u, seek %.0f us, %.0f MB/s\n\n", blocksize, seek_us,
+      mbps);
+  printf("%-6s %8s %5s %6s", "policy", "cache", "ra", "hit%");
+  for (k = 0; k < TRACE_KINDS; k++) {
+    if (present[k]) {
+      printf(" %6s", kind_names[k]);
+    }
+  }
+  printf(" %8s %8s %6s %11s\n", "devreads", "seeks", "ra%", "device ms");
+}
+
+static void print_row(int policy, uint32_t cap, uint32_t ahead,
+    const replay_stats *st, const int *present) {
+  uint64_t access = 0;
+  uint64_t hits = 0;
+  int k;
+
+  for (k = 0; k < TRACE_KINDS; k++) {
+    access += st->access[k];
+    hits += st->hits[k];
+  }
+  printf("%-6s %8u %5u %6.1f", policy_names[policy], cap, ahead,
+      pct(hits, access));
+  for (k = 0; k < TRACE_KINDS; k++) {
+    if (present[k]) {
+      printf(" %6.1f", pct(st->hits[k], st->access[k]));
+    }
+  }
+  printf(" %8llu %8llu %6.1f %11.2f\n",
+      (unsigned long long)(st->dev_reads + st->dev_writes),
+      (unsigned long long)st->seeks,
+      pct(st->prefetch_used, st->prefetched), st->dev_us / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+  mintrace_record *recs;
+  size_t n;
+  int present[TRACE_KINDS];
+  int p;
+  int s;
+  int r;
+
+  parse_options(argc, argv);
+  recs = load_trace(tracefile, &n);
+  summarize(recs, n, present);
+
+  for (p = 0; p < npolicies; p++) {
+    for (s = 0; s < nsizes; s++) {
+      for (r = 0; r < naheads; r++) {
+        replay_stats st;
+        replay(recs, n, policies[p], sizes[s], aheads[r], &st);
+        print_row(policies[p], sizes[s], aheads[r], &st, present);
+      }
+    }
+  }
+  free(recs);
+  return 0;
+}
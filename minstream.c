@@ -0,0 +1,649 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdlib.h>
+#include "minfs_common.h"
+#include "min.h"
+
+#define BASE 10
+#define MAXPART 3
+#define MINPART 0
+
+#define DIRENT_NAME_SIZE 60
+
+/* bytes thrown away per read when skipping forward in a pipe */
+#define SKIP_CHUNK 65536
+
+#define USAGE "usage: minstream [ -v ] [ -p num [ -s num ] ] " \
+  "imagefile|- [ path ]\n"
+
+/* the image, read front to back and never rewound */
+typedef struct {
+  FILE *in;
+  off_t pos;
+  int seekable;
+} stream;
+
+enum pending_kind {
+  PEND_DIRZONE,
+  PEND_TABLE,
+  PEND_TOP
+};
+
+/* a piece of a directory we will read once the stream gets there */
+typedef struct {
+  off_t    off;
+  uint32_t ino;
+  uint32_t length;
+  uint64_t file_off;
+  int      kind;
+} pending;
+
+/* min-heap of pending reads keyed by image offset */
+typedef struct {
+  pending *items;
+  size_t   count;
+  size_t   cap;
+} pending_heap;
+
+/* one name found in a directory */
+typedef struct {
+  uint32_t parent;
+  uint32_t ino;
+  uint32_t name;
+} found_entry;
+
+/* a name with its full path, for sorting the output */
+typedef struct {
+  char  *path;
+  size_t entry;
+} inventory_line;
+
+typedef struct {
+  fs_info fs;
+  minix_inode *inodes;
+  pending_heap heap;
+  found_entry *entries;
+  size_t nentries;
+  size_t entries_cap;
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+  uint32_t *dir_entry;
+  char **dir_path;
+  uint32_t missed;
+} stream_state;
+
+static int verbose = 0;
+static int primary = -1;
+static int subpart = -1;
+const char *imagefile = NULL;
+char *path = NULL;
+
+/* parse command line arguments */
+void parse_options(int argc, char *argv[]) {
+  int opt;
+  char *end;
+  const char *start;
+  int remain;
+
+  while ((opt = getopt(argc, argv, "vp:s:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'p':
+        primary = strtol(optarg, &end, BASE);
+        if (end == optarg || errno == ERANGE) {
+          fprintf(stderr, "-p usage: p <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        if (primary > MAXPART || primary < MINPART) {
+          fprintf(stderr,
+            "Partition %d out of range.  Must be 0..3.\n", primary);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 's':
+        subpart = strtol(optarg, &end, BASE);
+        if (end == optarg || errno == ERANGE) {
+          fprintf(stderr, "-s usage: s <num>\n");
+          exit(EXIT_FAILURE);
+        }
+        if (subpart > MAXPART || subpart < MINPART) {
+          fprintf(stderr,
+            "Partition %d out of range.  Must be 0..3.\n", subpart);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  /* subpartition requires a primary partition */
+  if (subpart != -1 && primary == -1) {
+    fprintf(stderr, "usage: -s requires -p\n");
+    exit(EXIT_FAILURE);
+  }
+
+  remain = argc - optind;
+  if (remain <= 0) {
+    fprintf(stderr, USAGE);
+    exit(EXIT_FAILURE);
+  }
+  imagefile = argv[optind++];
+
+  /* one leading slash, the way minls takes paths */
+  start = remain >= 2 ? argv[optind] : "/";
+  while (*start == '/') {
+    start++;
+  }
+  path = (char *)malloc(strlen(start) + 2);
+  if (path == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  path[0] = '/';
+  strcpy(path + 1, start);
+
+  if (verbose) {
+    printf("verbose:\n");
+    printf("imagefile: %s\n", imagefile);
+    printf("path: %s\n", path);
+    printf("partition: %d\n", primary);
+    printf("subpartition: %d\n", subpart);
+  }
+}
+
+static void *xrealloc(void *p, size_t size) {
+  void *q = realloc(p, size);
+  if (q == NULL) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  return q;
+}
+
+/* move the stream up to absolute offset to. a regular file just seeks,
+   a pipe gets read and thrown away. gives back 0 if the image ends
+   first */
+static int stream_advance(stream *st, off_t to) {
+  static uint8_t junk[SKIP_CHUNK];
+
+  if (to < st->pos) {
+    fprintf(stderr, "minstream: offset %lld is already behind us.\n",
+        (long long)to);
+    exit(EXIT_FAILURE);
+  }
+  if (to == st->pos) {
+    return 1;
+  }
+  if (st->seekable && fseeko(st->in, to, SEEK_SET) == 0) {
+    st->pos = to;
+    return 1;
+  }
+  st->seekable = 0;
+  while (st->pos < to) {
+    size_t want = SKIP_CHUNK;
+    size_t got;
+    if ((off_t)want > to - st->pos) {
+      want = (size_t)(to - st->pos);
+    }
+    got = fread(junk, 1, want, st->in);
+    if (got == 0) {
+      if (ferror(st->in)) {
+        perror("fread");
+        exit(EXIT_FAILURE);
+      }
+      return 0;
+    }
+    st->pos += got;
+  }
+  return 1;
+}
+
+/* read bytes at absolute offset at, which must not be behind us. gives
+   back 0 if the image ends first */
+static int stream_try_read(stream *st, void *buf, size_t bytes, off_t at) {
+  size_t got;
+
+  if (!stream_advance(st, at)) {
+    return 0;
+  }
+  got = fread(buf, 1, bytes, st->in);
+  if (ferror(st->in)) {
+    perror("fread");
+    exit(EXIT_FAILURE);
+  }
+  st->pos += got;
+  return got == bytes;
+}
+
+/* same, but running out of image is fatal */
+static void stream_read(stream *st, void *buf, size_t bytes, off_t at) {
+  if (!stream_try_read(st, buf, bytes, at)) {
+    fprintf(stderr, "minstream: image ends early.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void heap_push(pending_heap *h, const pending *p) {
+  size_t i;
+  if (h->count == h->cap) {
+    h->cap = h->cap ? h->cap * 2 : 64;
+    h->items = (pending *)xrealloc(h->items, h->cap * sizeof(pending));
+  }
+  i = h->count++;
+  while (i > 0 && h->items[(i - 1) / 2].off > p->off) {
+    h->items[i] = h->items[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  h->items[i] = *p;
+}
+
+static pending heap_pop(pending_heap *h) {
+  pending top = h->items[0];
+  pending last = h->items[--h->count];
+  size_t i = 0;
+
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= h->count) {
+      break;
+    }
+    if (c + 1 < h->count && h->items[c + 1].off < h->items[c].off) {
+      c++;
+    }
+    if (h->items[c].off >= last.off) {
+      break;
+    }
+    h->items[i] = h->items[c];
+    i = c;
+  }
+  if (h->count > 0) {
+    h->items[i] = last;
+  }
+  return top;
+}
+
+static void defer(stream_state *s, int kind, uint32_t zone, uint32_t ino,
+    uint64_t file_off) {
+  const minix_inode *in = &s->inodes[ino];
+  pending p;
+  uint64_t left;
+
+  if (zone == 0 || file_off >= in->size) {
+    return;
+  }
+  left = in->size - file_off;
+  p.off = (off_t)zone * s->fs.zonesize;
+  p.ino = ino;
+  p.kind = kind;
+  p.file_off = file_off;
+  p.length = left < s->fs.zonesize ? (uint32_t)left : s->fs.zonesize;
+  if (kind != PEND_DIRZONE) {
+    p.length = s->fs.sb.blocksize;
+  }
+  heap_push(&s->heap, &p);
+}
+
+/* queue the zones and tables the inode itself points at */
+static void defer_dir(stream_state *s, uint32_t ino) {
+  const minix_inode *in = &s->inodes[ino];
+  uint64_t zs = s->fs.zonesize;
+  uint64_t ptrs = s->fs.ptrs_per_blk;
+  int i;
+
+  for (i = 0; i < DIRECT_ZONES; i++) {
+    defer(s, PEND_DIRZONE, in->zone[i], ino, i * zs);
+  }
+  defer(s, PEND_TABLE, in->indirect, ino, DIRECT_ZONES * zs);
+  defer(s, PEND_TOP, in->two_indirect, ino, (DIRECT_ZONES + ptrs) * zs);
+}
+
+static uint32_t add_name(stream_state *s, const char *name, size_t len) {
+  uint32_t at = (uint32_t)s->names_len;
+  if (s->names_len + len + 1 > s->names_cap) {
+    s->names_cap = (s->names_cap + len + 1) * 2;
+    s->names = (char *)xrealloc(s->names, s->names_cap);
+  }
+  memcpy(s->names + s->names_len, name, len);
+  s->names[s->names_len + len] = '\0';
+  s->names_len += len + 1;
+  return at;
+}
+
+static void dir_zone(stream_state *s, const pending *p,
+    const uint8_t *buf) {
+  uint32_t n = p->length / sizeof(minix_dirent);
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    minix_dirent entry;
+    found_entry *f;
+    size_t len;
+
+    memcpy(&entry, buf + i * sizeof(minix_dirent), sizeof(entry));
+    fix_dirent(&s->fs, &entry);
+    if (entry.inode == 0 || entry.inode > s->fs.sb.ninodes) {
+      continue;
+    }
+    len = strnlen(entry.name, DIRENT_NAME_SIZE);
+    if ((len == 1 && entry.name[0] == '.') ||
+        (len == 2 && entry.name[0] == '.' && entry.name[1] == '.')) {
+      continue;
+    }
+    if (s->nentries == s->entries_cap) {
+      s->entries_cap = s->entries_cap ? s->entries_cap * 2 : 256;
+      s->entries = (found_entry *)xrealloc(s->entries,
+          s->entries_cap * sizeof(found_entry));
+    }
+    f = &s->entries[s->nentries];
+    f->parent = p->ino;
+    f->ino = entry.inode;
+    f->name = add_name(s, entry.name, len);
+    if ((s->inodes[entry.inode].mode & FILEMASK) == DIRECTORY &&
+        s->dir_entry[entry.inode] == 0) {
+      s->dir_entry[entry.inode] = (uint32_t)s->nentries + 1;
+    }
+    s->nentries++;
+  }
+}
+
+static void table_zone(stream_state *s, const pending *p, uint32_t *tbl) {
+  uint64_t zs = s->fs.zonesize;
+  uint64_t ptrs = s->fs.ptrs_per_blk;
+  uint32_t i;
+
+  fix_table(&s->fs, tbl, s->fs.ptrs_per_blk);
+  for (i = 0; i < s->fs.ptrs_per_blk; i++) {
+    if (p->kind == PEND_TABLE) {
+      defer(s, PEND_DIRZONE, tbl[i], p->ino, p->file_off + i * zs);
+    } else {
+      defer(s, PEND_TABLE, tbl[i], p->ino, p->file_off + i * ptrs * zs);
+    }
+  }
+}
+
+/* take pending reads lowest offset first. anything a table points back
+   at has already gone by and is counted as missed */
+static void drain(stream_state *s, stream *st) {
+  uint8_t *buf = (uint8_t *)malloc(s->fs.zonesize);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  while (s->heap.count > 0) {
+    pending p = heap_pop(&s->heap);
+    off_t at = fs_start + p.off;
+    if (at < st->pos) {
+      s->missed++;
+      continue;
+    }
+    stream_read(st, buf, p.length, at);
+    if (p.kind == PEND_DIRZONE) {
+      dir_zone(s, &p, buf);
+    } else {
+      table_zone(s, &p, (uint32_t *)buf);
+    }
+  }
+  free(buf);
+}
+
+/* full path of a directory, built from the names found on the way */
+static const char *dir_path(stream_state *s, uint32_t ino, int depth) {
+  const found_entry *f;
+  const char *parent;
+  char *p;
+  size_t len;
+
+  if (s->dir_path[ino] != NULL) {
+    return s->dir_path[ino];
+  }
+  if (ino == 1) {
+    p = strdup("");
+    if (p == NULL) {
+      perror("strdup");
+      exit(EXIT_FAILURE);
+    }
+    return s->dir_path[ino] = p;
+  }
+  if (s->dir_entry[ino] == 0 || depth > (int)s->fs.sb.ninodes) {
+    return "?";
+  }
+  f = &s->entries[s->dir_entry[ino] - 1];
+  parent = dir_path(s, f->parent, depth + 1);
+  len = strlen(parent) + 1 + strlen(s->names + f->name) + 1;
+  p = (char *)malloc(len);
+  if (p == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(p, len, "%s/%s", parent, s->names + f->name);
+  return s->dir_path[ino] = p;
+}
+
+static void print_line(uint16_t mode, uint32_t size, const char *parent,
+    const char *name) {
+  char perms[11] = "----------";
+  const char *rwx = "rwxrwxrwx";
+  int i;
+
+  if ((mode & FILEMASK) == DIRECTORY) {
+    perms[0] = 'd';
+  }
+  for (i = 0; i < 9; i++) {
+    if (mode & (0400 >> i)) {
+      perms[i + 1] = rwx[i];
+    }
+  }
+  if (printf("%s %9u %s/%s\n", perms, size, parent, name) < 0) {
+    perror("printf");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int cmp_lines(const void *a, const void *b) {
+  return strcmp(((const inventory_line *)a)->path,
+      ((const inventory_line *)b)->path);
+}
+
+/* print everything at or below prefix, in path order. gives back how
+   many lines that was */
+static size_t print_inventory(stream_state *s, const char *prefix) {
+  inventory_line *lines;
+  size_t plen = strlen(prefix);
+  size_t nlines = 0;
+  size_t i;
+
+  lines = (inventory_line *)malloc((s->nentries + 1) *
+      sizeof(inventory_line));
+  if (lines == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < s->nentries; i++) {
+    const found_entry *f = &s->entries[i];
+    const char *parent = dir_path(s, f->parent, 0);
+    size_t len = strlen(parent) + 1 + strlen(s->names + f->name) + 1;
+    char *full = (char *)malloc(len);
+    if (full == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    snprintf(full, len, "%s/%s", parent, s->names + f->name);
+    if (plen > 0 && (strncmp(full, prefix, plen) != 0 ||
+          (full[plen] != '\0' && full[plen] != '/'))) {
+      free(full);
+      continue;
+    }
+    lines[nlines].path = full;
+    lines[nlines].entry = i;
+    nlines++;
+  }
+  qsort(lines, nlines, sizeof(inventory_line), cmp_lines);
+  for (i = 0; i < nlines; i++) {
+    const found_entry *f = &s->entries[lines[i].entry];
+    const minix_inode *in = &s->inodes[f->ino];
+    print_line(in->mode, in->size, dir_path(s, f->parent, 0),
+        s->names + f->name);
+    free(lines[i].path);
+  }
+  free(lines);
+  return nlines;
+}
+
+/* follow entry which of the partition table at the front of head and
+   replace head with the start of that partition. the entry may have
+   been written big endian; the reading whose start looks like a minix
+   fs or another table wins, lower start first since the stream cannot
+   go back for the other one */
+static void stream_part(stream *st, uint8_t *head, int which) {
+  partition_entry entry;
+  uint32_t first[2];
+  uint32_t size[2];
+  int order[2] = { 0, 1 };
+  int i;
+
+  parse_part(head, which, &entry);
+  first[0] = entry.lFirst;
+  size[0] = entry.size;
+  first[1] = __builtin_bswap32(entry.lFirst);
+  size[1] = __builtin_bswap32(entry.size);
+  if (first[1] < first[0]) {
+    order[0] = 1;
+    order[1] = 0;
+  }
+  for (i = 0; i < 2; i++) {
+    int c = order[i];
+    off_t at = (off_t)first[c] * SECTOR_SIZE;
+    if (first[c] == 0 || at < st->pos) {
+      continue;
+    }
+    if (stream_try_read(st, head, PART_PROBE_SIZE, at) &&
+        part_start_valid(head)) {
+      fs_start = at;
+      fs_end = ((off_t)first[c] + size[c]) * SECTOR_SIZE;
+      return;
+    }
+  }
+  fprintf(stderr, "minstream: partition %d does not point at a minix "
+      "filesystem.\n", which);
+  exit(EXIT_FAILURE);
+}
+
+/* the partition tables and superblock, read in stream order. head always
+   holds the first PART_PROBE_SIZE bytes of the current level */
+static void stream_fs(stream *st, fs_info *fs) {
+  uint8_t head[PART_PROBE_SIZE];
+
+  fs_start = 0;
+  stream_read(st, head, sizeof(head), 0);
+  if (primary != -1) {
+    stream_part(st, head, primary);
+    if (subpart != -1) {
+      stream_part(st, head, subpart);
+    }
+  }
+  memcpy(&fs->sb, head + SUPERBLOCK_OFFSET, sizeof(superblock));
+  setup_superblock(fs);
+}
+
+int main(int argc, char *argv[]) {
+  stream st;
+  stream_state s;
+  uint32_t ino;
+  char *prefix;
+  size_t plen;
+
+  parse_options(argc, argv);
+
+  if (strcmp(imagefile, "-") == 0) {
+    st.in = stdin;
+  } else {
+    st.in = fopen(imagefile, "r");
+    if (st.in == NULL) {
+      perror("fopen");
+      exit(EXIT_FAILURE);
+    }
+  }
+  st.pos = 0;
+  st.seekable = 1;
+
+  memset(&s, 0, sizeof(s));
+  stream_fs(&st, &s.fs);
+  if (verbose) {
+    print_superblock(&s.fs);
+  }
+
+  /* the whole inode table is kept, it tells us every directory up front
+     so their zones can be queued before the stream reaches them */
+  s.inodes = (minix_inode *)calloc((size_t)s.fs.sb.ninodes + 1,
+      sizeof(minix_inode));
+  s.dir_entry = (uint32_t *)calloc((size_t)s.fs.sb.ninodes + 1,
+      sizeof(uint32_t));
+  s.dir_path = (char **)calloc((size_t)s.fs.sb.ninodes + 1,
+      sizeof(char *));
+  if (s.inodes == NULL || s.dir_entry == NULL || s.dir_path == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  stream_read(&st, &s.inodes[1],
+      (size_t)s.fs.sb.ninodes * sizeof(minix_inode),
+      fs_start + get_inode_offset(1, &s.fs));
+  for (ino = 1; ino <= s.fs.sb.ninodes; ino++) {
+    fix_inode(&s.fs, &s.inodes[ino]);
+    if (s.inodes[ino].links != 0 &&
+        (s.inodes[ino].mode & FILEMASK) == DIRECTORY) {
+      defer_dir(&s, ino);
+    }
+  }
+
+  drain(&s, &st);
+  if (verbose) {
+    printf("verbose: read through offset %lld, %zu names\n",
+        (long long)st.pos, s.nentries);
+  }
+  if (s.missed) {
+    fprintf(stderr,
+        "minstream: %u directory zones sat behind their tables and "
+        "were skipped.\n", s.missed);
+  }
+
+  /* paths are kept without the trailing slash, root is "" */
+  prefix = path;
+  plen = strlen(prefix);
+  while (plen > 1 && prefix[plen - 1] == '/') {
+    prefix[--plen] = '\0';
+  }
+  if (strcmp(prefix, "/") == 0) {
+    prefix[0] = '\0';
+  }
+  if (prefix[0] == '\0') {
+    print_line(s.inodes[1].mode, s.inodes[1].size, "", "");
+  }
+  if (print_inventory(&s, prefix) == 0 && prefix[0] != '\0') {
+    fprintf(stderr, "%s: file not found.\n", prefix);
+    s.missed++;
+  }
+
+  for (ino = 0; ino <= s.fs.sb.ninodes; ino++) {
+    free(s.dir_path[ino]);
+  }
+  free(s.dir_path);
+  free(s.dir_entry);
+  free(s.inodes);
+  free(s.entries);
+  free(s.names);
+  free(s.heap.items);
+  free(path);
+  if (st.in != stdin) {
+    fclose(st.in);
+  }
+  return s.missed ? EXIT_FAILURE : 0;
+}
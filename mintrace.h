@@ -0,0 +1,43 @@
+#ifndef MINTRACE_H
+#define MINTRACE_H
+
+#include <stdint.h>
+
+/* binary I/O trace written by readinto and writeinto when MINFS_TRACE
+   names a file, and read back by minreplay. a header and then one
+   record per call, in host byte order */
+
+#define MINTRACE_MAGIC   0x4D545243
+#define MINTRACE_VERSION 1
+
+/* what a read or write was for. callers say so with trace_kind before
+   doing the I/O */
+enum trace_kind {
+  TRACE_OTHER    = 0,
+  TRACE_PART     = 1,
+  TRACE_SUPER    = 2,
+  TRACE_BITMAP   = 3,
+  TRACE_INODE    = 4,
+  TRACE_DIRENT   = 5,
+  TRACE_INDIRECT = 6,
+  TRACE_DATA     = 7,
+  TRACE_KINDS    = 8
+};
+
+/* or'd into kind for writes */
+#define TRACE_WRITE 0x80
+
+typedef struct __attribute__((packed)) mintrace_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+} mintrace_header;
+
+/* offset is from the start of the image file, partition included */
+typedef struct __attribute__((packed)) mintrace_record {
+  uint64_t offset;
+  uint32_t length;
+  uint8_t  kind;
+} mintrace_record;
+
+#endif